@@ -2,11 +2,25 @@
 
 #include <iostream>
 #include <string>
+#include <fstream>
+#include <vector>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <atomic>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <algorithm>
 
 #include <boost/algorithm/string.hpp>
 
@@ -31,6 +45,32 @@ namespace ns_util
             // boost::token_compress_on ： 分隔符之间无数据不存储
             boost::split((*target), src, boost::is_any_of(sep), boost::token_compress_on);
         }
+
+        /**
+         * @brief FNV-1a 64位哈希
+         * 非加密哈希，只用于生成文件名、分桶等，不能作为内容相同的依据
+         */
+        static uint64_t Hash(const std::string &src)
+        {
+            uint64_t h = 14695981039346656037ULL;
+            for (unsigned char c : src)
+            {
+                h ^= c;
+                h *= 1099511628211ULL;
+            }
+            return h;
+        }
+
+        /**
+         * @brief 哈希值的16位十六进制表示
+         *
+         */
+        static std::string HashToHex(const std::string &src)
+        {
+            char buf[17];
+            snprintf(buf, sizeof buf, "%016llx", (unsigned long long)Hash(src));
+            return buf;
+        }
     };
 
     class TimeUtil
@@ -189,6 +229,33 @@ namespace ns_util
             return true;
         }
 
+        /**
+         * @brief 列出目录中以suffix结尾的文件，names为去掉suffix后的文件名
+         * 按编号排序：较短的在前，如 2 在 10 之前
+         * return：目录无法打开时为假
+         */
+        static bool ListFiles(const std::string &dir, const std::string &suffix, std::vector<std::string> *names)
+        {
+            DIR *d = opendir(dir.c_str());
+            if (nullptr == d)
+            {
+                return false;
+            }
+            struct dirent *ent;
+            while (nullptr != (ent = readdir(d)))
+            {
+                std::string name = ent->d_name;
+                if (name.size() > suffix.size() && 0 == name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+                {
+                    names->push_back(name.substr(0, name.size() - suffix.size()));
+                }
+            }
+            closedir(d);
+            std::sort(names->begin(), names->end(), [](const std::string &a, const std::string &b)
+                      { return a.size() != b.size() ? a.size() < b.size() : a < b; });
+            return true;
+        }
+
         /**
          * @brief 读文件
          * 
@@ -215,4 +282,192 @@ namespace ns_util
             return true;
         }
     };
+
+    class SysUtil
+    {
+    public:
+        /**
+         * @brief 在线的CPU核数，至少为1
+         *
+         */
+        static int CpuCores()
+        {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            return n > 0 ? static_cast<int>(n) : 1;
+        }
+
+        /**
+         * @brief 可用内存 (KB)，读取 /proc/meminfo 的 MemAvailable，失败时为0
+         *
+         */
+        static long MemAvailableKB()
+        {
+            return MemInfoKB("MemAvailable:");
+        }
+
+        /**
+         * @brief 物理内存总量 (KB)，读取 /proc/meminfo 的 MemTotal，失败时为0
+         *
+         */
+        static long MemTotalKB()
+        {
+            return MemInfoKB("MemTotal:");
+        }
+
+        /**
+         * @brief 获取进程的pidfd(带CLOEXEC)，内核不支持(< 5.3)时为-1
+         * pidfd始终指向同一个进程，进程被回收、pid被复用后也不会误发信号
+         */
+        static int PidfdOpen(pid_t pid)
+        {
+#ifdef SYS_pidfd_open
+            return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+            errno = ENOSYS;
+            return -1;
+#endif
+        }
+
+        /**
+         * @brief 向进程发送信号，pidFd >= 0 时通过pidfd发送，否则按pid发送
+         *
+         */
+        static int SendSignal(pid_t pid, int pidFd, int sig)
+        {
+#ifdef SYS_pidfd_send_signal
+            if (pidFd >= 0)
+            {
+                return static_cast<int>(syscall(SYS_pidfd_send_signal, pidFd, sig, nullptr, 0));
+            }
+#endif
+            return kill(pid, sig);
+        }
+
+        /**
+         * @brief 最近1分钟的平均负载，失败时为0
+         *
+         */
+        static double LoadAvg()
+        {
+            double avg[1];
+            return 1 == getloadavg(avg, 1) ? avg[0] : 0;
+        }
+
+    private:
+        // key包含冒号，如 "MemTotal:"
+        static long MemInfoKB(const std::string &key)
+        {
+            std::ifstream in("/proc/meminfo");
+            std::string line;
+            while (std::getline(in, line))
+            {
+                if (line.compare(0, key.size(), key) == 0)
+                {
+                    return atol(line.c_str() + key.size());
+                }
+            }
+            return 0;
+        }
+    };
+
+    class PipeUtil
+    {
+    public:
+        /**
+         * @brief 与子进程通过管道交互，直到子进程退出
+         * pid：子进程
+         * inFd：子进程标准输入的写端，写完 in 后关闭，可为-1
+         * outFd/errFd：子进程标准输出/标准错误的读端，内容追加到 out/err，可为-1
+         * return：waitpid得到的子进程状态
+         *
+         * 所有传入的fd都由本函数关闭
+         * 子进程退出后只读取管道中已有的数据，避免其子进程继续持有管道导致一直阻塞
+         */
+        static int Communicate(pid_t pid, int inFd, const std::string &in, int outFd, std::string *out, int errFd, std::string *err)
+        {
+            return Communicate([pid](bool block, int *status)
+                               { return waitpid(pid, status, block ? 0 : WNOHANG) == pid; },
+                               inFd, in, outFd, out, errFd, err);
+        }
+
+        /**
+         * @brief 同上，子进程不是本进程创建时(如zygote)，由 reap 获取退出状态
+         * reap(block, status)：block为真时阻塞等待，返回真表示子进程已退出，状态写入status
+         */
+        static int Communicate(const std::function<bool(bool, int *)> &reap, int inFd, const std::string &in, int outFd, std::string *out, int errFd, std::string *err)
+        {
+            struct Channel
+            {
+                int fd;
+                std::string *buf;
+            };
+            std::vector<Channel> readers;
+            if (outFd >= 0)
+                readers.push_back({outFd, out});
+            if (errFd >= 0)
+                readers.push_back({errFd, err});
+            for (auto &ch : readers)
+                fcntl(ch.fd, F_SETFL, fcntl(ch.fd, F_GETFL) | O_NONBLOCK);
+            if (inFd >= 0)
+                fcntl(inFd, F_SETFL, fcntl(inFd, F_GETFL) | O_NONBLOCK);
+
+            size_t written = 0;
+            bool exited = false;
+            int status = 0;
+            char buf[4096];
+            while (inFd >= 0 || !readers.empty())
+            {
+                std::vector<struct pollfd> fds;
+                for (auto &ch : readers)
+                    fds.push_back({ch.fd, POLLIN, 0});
+                if (inFd >= 0)
+                    fds.push_back({inFd, POLLOUT, 0});
+
+                // 子进程退出后不再等待，只做一次非阻塞读取
+                int n = poll(fds.data(), fds.size(), exited ? 0 : 50);
+                if (n < 0 && errno != EINTR)
+                    break;
+
+                for (size_t i = 0; i < readers.size(); i++)
+                {
+                    if (!exited && !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                        continue;
+                    ssize_t r;
+                    while ((r = read(readers[i].fd, buf, sizeof buf)) > 0)
+                        readers[i].buf->append(buf, r);
+                    if (r == 0 || exited || (r < 0 && errno != EAGAIN && errno != EINTR))
+                    {
+                        close(readers[i].fd);
+                        readers[i].fd = -1;
+                    }
+                }
+                if (inFd >= 0 && (exited || fds.back().revents))
+                {
+                    ssize_t w = exited ? -1 : write(inFd, in.data() + written, in.size() - written);
+                    if (w > 0)
+                        written += w;
+                    if (written == in.size() || (w < 0 && errno != EAGAIN && errno != EINTR))
+                    {
+                        close(inFd);
+                        inFd = -1;
+                    }
+                }
+                for (auto iter = readers.begin(); iter != readers.end();)
+                    iter = (iter->fd < 0) ? readers.erase(iter) : iter + 1;
+
+                if (exited)
+                    break;
+                if (reap(false, &status))
+                    exited = true;
+            }
+
+            if (inFd >= 0)
+                close(inFd);
+            for (auto &ch : readers)
+                close(ch.fd);
+            if (!exited)
+                reap(true, &status);
+            return status;
+        }
+    };
 }
\ No newline at end of file
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+namespace ns_worker_pool
+{
+    /**
+     * @brief 固定线程数、队列长度有上限的线程池
+     * TryPush：队列已满时立即失败，用于拒绝超出处理能力的请求
+     * Push：队列已满时阻塞等待，用于流水线上下游之间的背压
+     * Post：不受队列长度限制，用于已接收任务的后续步骤
+     */
+    class WorkerPool
+    {
+    public:
+        WorkerPool(const std::string &name, size_t threads, size_t maxQueue)
+            : _name(name), _maxQueue(maxQueue), _busy(0), _shutdown(false)
+        {
+            for (size_t i = 0; i < threads; i++)
+            {
+                _threads.emplace_back(&WorkerPool::Worker, this);
+            }
+        }
+        ~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                _shutdown = true;
+            }
+            _notEmpty.notify_all();
+            _notFull.notify_all();
+            for (auto &t : _threads)
+            {
+                t.join();
+            }
+        }
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        /**
+         * @brief 添加任务，队列已满时返回假
+         *
+         */
+        bool TryPush(std::function<void()> task)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_shutdown || _tasks.size() >= _maxQueue)
+            {
+                return false;
+            }
+            _tasks.push_back(std::move(task));
+            _notEmpty.notify_one();
+            return true;
+        }
+
+        /**
+         * @brief 添加任务，队列已满时等待
+         *
+         */
+        void Push(std::function<void()> task)
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _notFull.wait(lock, [this]
+                          { return _shutdown || _tasks.size() < _maxQueue; });
+            if (_shutdown)
+            {
+                return;
+            }
+            _tasks.push_back(std::move(task));
+            _notEmpty.notify_one();
+        }
+
+        /**
+         * @brief 添加已接收任务的后续步骤，不受队列长度限制，不阻塞
+         * 供不能等待的线程(如运行监控线程)把程序退出后的处理交回线程池
+         */
+        void Post(std::function<void()> task)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_shutdown)
+            {
+                return;
+            }
+            _tasks.push_back(std::move(task));
+            _notEmpty.notify_one();
+        }
+
+        size_t Threads() const
+        {
+            return _threads.size();
+        }
+        size_t MaxQueue() const
+        {
+            return _maxQueue;
+        }
+        // 排队中的任务数
+        size_t Queued()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            return _tasks.size();
+        }
+        // 执行中的任务数
+        size_t Busy() const
+        {
+            return _busy;
+        }
+        const std::string &Name() const
+        {
+            return _name;
+        }
+
+    private:
+        void Worker()
+        {
+            while (true)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(_mtx);
+                    _notEmpty.wait(lock, [this]
+                                   { return _shutdown || !_tasks.empty(); });
+                    if (_shutdown && _tasks.empty())
+                    {
+                        return;
+                    }
+                    task = std::move(_tasks.front());
+                    _tasks.pop_front();
+                    ++_busy;
+                }
+                _notFull.notify_one();
+                task();
+                --_busy;
+            }
+        }
+
+    private:
+        std::string _name;
+        size_t _maxQueue;
+        std::atomic<size_t> _busy;
+        bool _shutdown;
+        std::deque<std::function<void()>> _tasks;
+        std::vector<std::thread> _threads;
+        std::mutex _mtx;
+        std::condition_variable _notEmpty;
+        std::condition_variable _notFull;
+    };
+}
@@ -0,0 +1,55 @@
+/*
+* 创建子进程的耗时对比：fork vs clone(CLONE_VM | CLONE_VFORK)
+* ./spawn_bench [次数] [常驻内存(MB)]
+*
+* 常驻内存模拟编译服务的内存占用，fork需要复制的页表随之增长
+*/
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <sys/wait.h>
+
+#include "../spawner.hpp"
+
+using namespace ns_spawner;
+
+static double BenchOnce(SpawnMode mode, int times)
+{
+    Spawner::SetMode(mode);
+    SpawnOptions opt;
+    opt.args = {"/bin/true"};
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < times; i++)
+    {
+        pid_t pid = Spawner::Spawn(opt);
+        if (pid < 0)
+        {
+            std::cerr << "spawn失败" << std::endl;
+            exit(1);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - begin).count() / times;
+}
+
+int main(int argc, char *argv[])
+{
+    int times = argc > 1 ? atoi(argv[1]) : 1000;
+    size_t ballastMB = argc > 2 ? atoi(argv[2]) : 1024;
+
+    // 触碰每一页，保证页表真实存在
+    std::vector<char> ballast(ballastMB << 20);
+    memset(ballast.data(), 1, ballast.size());
+
+    std::cout << "次数：" << times << "，常驻内存：" << ballastMB << "MB" << std::endl;
+    std::cout << "fork + exec：  " << BenchOnce(SpawnMode::Fork, times) << " us/次" << std::endl;
+    std::cout << "vfork + exec： " << BenchOnce(SpawnMode::VFork, times) << " us/次" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,326 @@
+/*
+* cgroup v2 资源隔离(可选)
+* RLIMIT_AS 限制的是虚拟地址空间，只申请不使用内存的程序也会失败，且无法限制fork炸弹与页缓存
+* 启用后每个运行槽位对应一个预先创建的cgroup：root/slot-N，同一时刻只运行一个程序
+*   memory.max：内存上限(含页缓存)，不再设置RLIMIT_AS
+*   pids.max：进程/线程数上限
+*   cpu.max：最多使用一个CPU，多线程程序不会挤占其他程序
+* 程序在exec之前加入cgroup(向cgroup.procs写入"0")，结束后读取 memory.peak 与 cpu.stat，并终止残留的进程
+*
+* root需要是cgroup v2目录，且父cgroup已开启memory、pids、cpu控制器(如systemd的Delegate=yes)
+* 有进程的cgroup不能为子cgroup开启控制器：服务位于root中时移入root/service，因此必须在启动zygote之前初始化
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "../comm/log.hpp"
+#include "../comm/util.hpp"
+
+namespace ns_cgroup
+{
+    using namespace ns_log;
+    using namespace ns_util;
+
+    const long cgroup2SuperMagic = 0x63677270;              // statfs的f_type，同 linux/magic.h 中的 CGROUP2_SUPER_MAGIC
+    const std::string cgroupControllers = "+memory +pids +cpu"; // 为运行槽位开启的控制器
+    const int cgroupPidsMax = 64;                           // 每个程序的进程/线程数上限
+    const std::string cgroupCpuMax = "100000 100000";       // 每100ms最多使用100ms CPU，即一个CPU
+
+    // 一个运行槽位对应的cgroup
+    class CgroupSlot
+    {
+    public:
+        CgroupSlot(const std::string &path) : _path(path), _procsFd(-1), _peakFd(-1), _peakResettable(false), _cpuUsecBase(0), _oomBase(0) {}
+        ~CgroupSlot()
+        {
+            if (_procsFd >= 0)
+                close(_procsFd);
+            if (_peakFd >= 0)
+                close(_peakFd);
+        }
+
+        /**
+         * @brief 创建cgroup并设置与程序无关的限制
+         *
+         */
+        bool Create()
+        {
+            if (0 != mkdir(_path.c_str(), 0755) && errno != EEXIST)
+            {
+                LOG(ERROR) << "创建cgroup失败：" << _path << "，errno：" << errno << std::endl;
+                return false;
+            }
+            // 上次运行服务时残留的进程
+            KillAll();
+            if (!Write("pids.max", std::to_string(cgroupPidsMax)) || !Write("cpu.max", cgroupCpuMax))
+            {
+                return false;
+            }
+            Write("memory.swap.max", "0", false); // 未开启swap记账时不存在
+            _procsFd = open((_path + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+            if (_procsFd < 0)
+            {
+                LOG(ERROR) << "打开cgroup.procs失败：" << _path << "，errno：" << errno << std::endl;
+                return false;
+            }
+            // 向memory.peak写入后，通过同一个fd读到的是写入之后的峰值(5.19+可读，6.12+可重置)
+            _peakFd = open((_path + "/memory.peak").c_str(), O_RDWR | O_CLOEXEC);
+            _peakResettable = _peakFd >= 0;
+            if (_peakFd < 0)
+            {
+                _peakFd = open((_path + "/memory.peak").c_str(), O_RDONLY | O_CLOEXEC);
+            }
+            return true;
+        }
+
+        /**
+         * @brief 运行程序之前调用：设置内存上限，记录CPU时间与OOM次数的起点，重置内存峰值
+         * memLimitKB：内存上限 (KB)，0为不限制
+         */
+        bool Prepare(long memLimitKB)
+        {
+            if (!Write("memory.max", memLimitKB > 0 ? std::to_string(memLimitKB * 1024) : "max"))
+            {
+                return false;
+            }
+            _cpuUsecBase = ReadKey("cpu.stat", "usage_usec");
+            _oomBase = ReadKey("memory.events", "oom_kill");
+            if (_peakResettable && write(_peakFd, "reset", 5) != 5)
+            {
+                _peakResettable = false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief 子进程exec之前向该fd写入"0"，加入本cgroup
+         *
+         */
+        int ProcsFd()
+        {
+            return _procsFd;
+        }
+
+        /**
+         * @brief 程序结束后调用：读取资源使用，终止残留的进程
+         * cpuMs：本次运行的CPU时间 (ms)，含程序创建的子进程
+         * peakKB：本次运行的内存峰值 (KB)，内核不支持重置memory.peak时为-1
+         * oomKilled：是否因超出内存上限被终止
+         */
+        void Collect(long *cpuMs, long *peakKB, bool *oomKilled)
+        {
+            KillAll();
+            *cpuMs = (ReadKey("cpu.stat", "usage_usec") - _cpuUsecBase) / 1000;
+            *oomKilled = ReadKey("memory.events", "oom_kill") > _oomBase;
+            *peakKB = -1;
+            if (_peakResettable)
+            {
+                char buf[32] = {0};
+                if (pread(_peakFd, buf, sizeof buf - 1, 0) > 0)
+                {
+                    *peakKB = atol(buf) / 1024;
+                }
+            }
+        }
+
+        /**
+         * @brief 写入cgroup文件，内核拒绝时write返回错误，ofstream无法区分
+         *
+         */
+        static bool WriteValue(const std::string &path, const std::string &value)
+        {
+            int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+            bool ok = fd >= 0 && write(fd, value.c_str(), value.size()) == (ssize_t)value.size();
+            if (fd >= 0)
+            {
+                int err = errno;
+                close(fd);
+                errno = err;
+            }
+            return ok;
+        }
+
+    private:
+        /**
+         * @brief 终止cgroup中的所有进程，如用户程序fork出的后代
+         * cgroup.kill(5.14+)不存在时逐个发送SIGKILL
+         */
+        void KillAll()
+        {
+            if (Write("cgroup.kill", "1", false))
+            {
+                return;
+            }
+            std::ifstream in(_path + "/cgroup.procs");
+            pid_t pid;
+            while (in >> pid)
+            {
+                kill(pid, SIGKILL);
+            }
+        }
+
+        bool Write(const std::string &file, const std::string &value, bool logError = true)
+        {
+            std::string path = _path + "/" + file;
+            bool ok = WriteValue(path, value);
+            if (!ok && logError)
+            {
+                LOG(WARNING) << "写入cgroup文件失败：" << path << "，errno：" << errno << std::endl;
+            }
+            return ok;
+        }
+
+        // 读取 "key value" 格式文件中的值，失败时为0
+        long ReadKey(const std::string &file, const std::string &key)
+        {
+            std::ifstream in(_path + "/" + file);
+            std::string k;
+            long v;
+            while (in >> k >> v)
+            {
+                if (k == key)
+                {
+                    return v;
+                }
+            }
+            return 0;
+        }
+
+    private:
+        std::string _path;
+        int _procsFd;
+        int _peakFd;
+        bool _peakResettable;
+        long _cpuUsecBase;
+        long _oomBase;
+    };
+
+    class CgroupPool
+    {
+    private:
+        CgroupPool() : _enabled(false) {}
+        CgroupPool(const CgroupPool &) = delete;
+        CgroupPool &operator=(const CgroupPool &) = delete;
+
+    public:
+        static CgroupPool &GetInstance()
+        {
+            static CgroupPool pool;
+            return pool;
+        }
+
+        /**
+         * @brief 启用cgroup v2后端，必须在启动zygote、创建任何线程之前调用
+         * root：服务可写的cgroup v2目录，不存在时创建
+         * return：失败时为假，运行时仍使用rlimit
+         */
+        bool Init(const std::string &root)
+        {
+            struct statfs fs;
+            if (0 != mkdir(root.c_str(), 0755) && errno != EEXIST)
+            {
+                LOG(ERROR) << "创建cgroup失败：" << root << "，errno：" << errno << std::endl;
+                return false;
+            }
+            if (0 != statfs(root.c_str(), &fs) || fs.f_type != cgroup2SuperMagic)
+            {
+                LOG(ERROR) << root << "不是cgroup v2目录" << std::endl;
+                return false;
+            }
+            std::string available;
+            FileUtil::ReadFile(root + "/cgroup.controllers", &available);
+            available = " " + available + " ";
+            std::istringstream required(cgroupControllers);
+            std::string controller;
+            while (required >> controller)
+            {
+                if (available.find(" " + controller.substr(1) + " ") == std::string::npos)
+                {
+                    LOG(ERROR) << "cgroup未开启" << controller.substr(1) << "控制器：" << root << std::endl;
+                    return false;
+                }
+            }
+            // 服务位于root中时移入root/service
+            std::ifstream procs(root + "/cgroup.procs");
+            pid_t pid;
+            while (procs >> pid)
+            {
+                if (pid != getpid())
+                {
+                    continue;
+                }
+                std::string service = root + "/service";
+                if ((0 != mkdir(service.c_str(), 0755) && errno != EEXIST) || !CgroupSlot::WriteValue(service + "/cgroup.procs", "0"))
+                {
+                    LOG(ERROR) << "服务无法移出cgroup：" << root << std::endl;
+                    return false;
+                }
+                break;
+            }
+            if (!CgroupSlot::WriteValue(root + "/cgroup.subtree_control", cgroupControllers))
+            {
+                LOG(ERROR) << "cgroup无法为子cgroup开启控制器：" << root << "，errno：" << errno << std::endl;
+                return false;
+            }
+            _root = root;
+            _enabled = true;
+            LOG(INFO) << "cgroup v2资源隔离已开启：" << root << std::endl;
+            return true;
+        }
+
+        bool Enabled()
+        {
+            return _enabled;
+        }
+
+        /**
+         * @brief 取得一个空闲的运行槽位，没有时创建
+         * return：创建失败时为nullptr
+         */
+        CgroupSlot *Acquire()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (!_free.empty())
+            {
+                CgroupSlot *slot = _free.back();
+                _free.pop_back();
+                return slot;
+            }
+            std::unique_ptr<CgroupSlot> slot(new CgroupSlot(_root + "/slot-" + std::to_string(_slots.size())));
+            if (!slot->Create())
+            {
+                return nullptr;
+            }
+            _slots.push_back(std::move(slot));
+            return _slots.back().get();
+        }
+
+        void Release(CgroupSlot *slot)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _free.push_back(slot);
+        }
+
+    private:
+        bool _enabled;
+        std::string _root;
+        std::mutex _mtx;
+        std::vector<std::unique_ptr<CgroupSlot>> _slots;
+        std::vector<CgroupSlot *> _free;
+    };
+}
@@ -0,0 +1,287 @@
+/*
+* 编译缓存模块
+* 以 源代码+编译选项 为键，缓存编译得到的可执行程序
+* 相同的代码(重复提交、模板题解)命中缓存后，不再调用g++
+* 磁盘模式缓存 ./temp/cache/ 下的文件，不落盘模式缓存只读的memfd
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+namespace ns_compile_cache
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    const std::string cacheDirPath = "./temp/cache/"; // 缓存的可执行程序所在目录
+    const size_t cacheMaxEntries = 1024;              // 最多缓存的可执行程序个数
+    const uint64_t cacheMaxBytes = 256ULL << 20;      // 缓存占用磁盘的上限 (B)
+
+    class CompileCache
+    {
+    private:
+        struct Entry
+        {
+            std::string key;                     // 源代码+编译选项，命中时逐字节比对，避免哈希冲突
+            uint64_t size;                       // 可执行程序大小 (B)
+            int fd;                              // 不落盘模式下缓存的memfd，磁盘模式为-1
+            std::list<std::string>::iterator pos; // 在LRU链表中的位置
+        };
+
+    public:
+        /**
+         * @brief 全局唯一的编译缓存
+         *
+         */
+        static CompileCache &GetInstance()
+        {
+            static CompileCache instance;
+            return instance;
+        }
+        CompileCache(const CompileCache &) = delete;
+        CompileCache &operator=(const CompileCache &) = delete;
+
+        /**
+         * @brief 构建缓存键
+         * code：最终参与编译的源代码
+         * harness：与代码一起链接的测试框架源码，可为空
+         * flags：编译选项
+         */
+        static std::string BuildKey(const std::string &code, const std::string &harness, const std::vector<std::string> &flags)
+        {
+            std::string key;
+            for (const auto &flag : flags)
+            {
+                key += flag;
+                key += '\0';
+            }
+            key += '\0';
+            key += harness;
+            key += '\0';
+            key += code;
+            return key;
+        }
+
+        /**
+         * @brief 查找缓存
+         * 命中时将缓存的可执行程序硬链接为 fileName.exe，后续运行与删除流程保持不变
+         * return：真为命中
+         */
+        bool Lookup(const std::string &key, const std::string &fileName)
+        {
+            std::string hash = StringUtil::HashToHex(key);
+
+            std::lock_guard<std::mutex> lock(_mtx);
+            auto iter = _entries.find(hash);
+            if (iter == _entries.end() || iter->second.key != key || iter->second.fd >= 0)
+            {
+                ++_misses;
+                return false;
+            }
+            if (0 != link((cacheDirPath + hash).c_str(), PathUtil::BuildExe(fileName).c_str()))
+            {
+                // 缓存文件被外部删除等情况，丢弃该条目
+                LOG(WARNING) << "编译缓存文件失效：" << hash << "，errno：" << errno << std::endl;
+                EraseLocked(iter);
+                ++_misses;
+                return false;
+            }
+            _lru.splice(_lru.begin(), _lru, iter->second.pos);
+            ++_hits;
+            LOG(INFO) << "编译缓存命中：" << hash << "，命中/未命中：" << _hits << "/" << _misses << std::endl;
+            return true;
+        }
+
+        /**
+         * @brief 将编译成功的 fileName.exe 加入缓存
+         * 超出条目数或磁盘上限时，淘汰最久未使用的程序
+         */
+        void Insert(const std::string &key, const std::string &fileName)
+        {
+            std::string hash = StringUtil::HashToHex(key);
+            std::string cachePath = cacheDirPath + hash;
+
+            struct stat st;
+            if (0 != stat(PathUtil::BuildExe(fileName).c_str(), &st))
+            {
+                return;
+            }
+            uint64_t size = st.st_size;
+            if (size > cacheMaxBytes)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(_mtx);
+            auto iter = _entries.find(hash);
+            if (iter != _entries.end())
+            {
+                if (iter->second.key == key)
+                {
+                    // 并发编译了相同的代码，已有缓存
+                    _lru.splice(_lru.begin(), _lru, iter->second.pos);
+                    return;
+                }
+                // 哈希冲突，新代码替换旧代码
+                EraseLocked(iter);
+            }
+
+            unlink(cachePath.c_str());
+            if (0 != link(PathUtil::BuildExe(fileName).c_str(), cachePath.c_str()))
+            {
+                LOG(WARNING) << "写入编译缓存失败：" << hash << "，errno：" << errno << std::endl;
+                return;
+            }
+
+            _lru.push_front(hash);
+            _entries[hash] = Entry{key, size, -1, _lru.begin()};
+            _bytes += size;
+
+            while (_entries.size() > cacheMaxEntries || _bytes > cacheMaxBytes)
+            {
+                EraseLocked(_entries.find(_lru.back()));
+            }
+        }
+
+        /**
+         * @brief 查找缓存，不落盘模式
+         * 命中时 fd 为缓存程序的副本(dup)，调用者负责关闭
+         * return：真为命中
+         */
+        bool LookupFd(const std::string &key, int *fd)
+        {
+            std::string hash = StringUtil::HashToHex(key);
+
+            std::lock_guard<std::mutex> lock(_mtx);
+            auto iter = _entries.find(hash);
+            if (iter == _entries.end() || iter->second.key != key || iter->second.fd < 0)
+            {
+                ++_misses;
+                return false;
+            }
+            *fd = fcntl(iter->second.fd, F_DUPFD_CLOEXEC, 0);
+            if (*fd < 0)
+            {
+                ++_misses;
+                return false;
+            }
+            _lru.splice(_lru.begin(), _lru, iter->second.pos);
+            ++_hits;
+            LOG(INFO) << "编译缓存命中(内存)：" << hash << "，命中/未命中：" << _hits << "/" << _misses << std::endl;
+            return true;
+        }
+
+        /**
+         * @brief 将编译成功的程序 fd 加入缓存，不落盘模式
+         * 缓存保存 fd 的副本，调用者仍持有并负责关闭 fd
+         */
+        void InsertFd(const std::string &key, int fd)
+        {
+            std::string hash = StringUtil::HashToHex(key);
+
+            struct stat st;
+            if (0 != fstat(fd, &st))
+            {
+                return;
+            }
+            uint64_t size = st.st_size;
+            if (size > cacheMaxBytes)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(_mtx);
+            auto iter = _entries.find(hash);
+            if (iter != _entries.end())
+            {
+                if (iter->second.key == key)
+                {
+                    _lru.splice(_lru.begin(), _lru, iter->second.pos);
+                    return;
+                }
+                EraseLocked(iter);
+            }
+
+            int dupFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            if (dupFd < 0)
+            {
+                return;
+            }
+
+            _lru.push_front(hash);
+            _entries[hash] = Entry{key, size, dupFd, _lru.begin()};
+            _bytes += size;
+
+            while (_entries.size() > cacheMaxEntries || _bytes > cacheMaxBytes)
+            {
+                EraseLocked(_entries.find(_lru.back()));
+            }
+        }
+
+        uint64_t Hits() const
+        {
+            return _hits;
+        }
+        uint64_t Misses() const
+        {
+            return _misses;
+        }
+
+    private:
+        CompileCache()
+            : _bytes(0), _hits(0), _misses(0)
+        {
+            // 索引只保存在内存中，上次运行遗留的缓存文件无法复用，全部清除
+            mkdir(cacheDirPath.c_str(), 0755);
+            DIR *dir = opendir(cacheDirPath.c_str());
+            if (dir)
+            {
+                struct dirent *ent;
+                while ((ent = readdir(dir)) != nullptr)
+                {
+                    if (ent->d_name[0] != '.')
+                    {
+                        unlink((cacheDirPath + ent->d_name).c_str());
+                    }
+                }
+                closedir(dir);
+            }
+        }
+
+        void EraseLocked(std::unordered_map<std::string, Entry>::iterator iter)
+        {
+            if (iter->second.fd >= 0)
+                close(iter->second.fd);
+            else
+                unlink((cacheDirPath + iter->first).c_str());
+            _bytes -= iter->second.size;
+            _lru.erase(iter->second.pos);
+            _entries.erase(iter);
+        }
+
+    private:
+        std::list<std::string> _lru;                      // 表头为最近使用的哈希
+        std::unordered_map<std::string, Entry> _entries; // 哈希->缓存条目
+        uint64_t _bytes;                                  // 缓存程序的总大小
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::mutex _mtx;
+    };
+}
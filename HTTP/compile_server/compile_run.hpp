@@ -1,9 +1,20 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include <jsoncpp/json/json.h>
 
 #include "./compiler.hpp"
 #include "./runner.hpp"
+#include "./compile_cache.hpp"
+#include "./harness_cache.hpp"
+#include "./test_data.hpp"
 
 namespace ns_compile_and_run
 {
@@ -11,6 +22,52 @@ namespace ns_compile_and_run
     using namespace ns_util;
     using namespace ns_compiler;
     using namespace ns_runner;
+    using namespace ns_compile_cache;
+    using namespace ns_harness_cache;
+    using namespace ns_test_data;
+
+    const int wallLimitFactor = 2;             // 未指定墙钟时间时为CPU时间的倍数，与测试框架原先的 alarm(2) 一致
+    const int defaultWallLimitMs = 10 * 1000;  // 未限制CPU时间时的墙钟时间上限 (ms)
+    const int defaultOutputLimitKB = 16 * 1024; // 程序标准输出与标准错误合计的默认上限 (KB)
+
+    // 把程序结束后的处理交给某个线程执行，如流水线的运行线程池
+    typedef std::function<void(const std::function<void()> &)> Executor;
+
+    // 一次编译运行请求，在编译、运行两个阶段之间传递
+    struct Job
+    {
+        // 输入
+        std::string code;
+        std::string input;
+        std::string number;
+        std::string harness;
+        int cpuLimitMs = 0;  // CPU时间上限 (ms)，0为不限制
+        int wallLimitMs = 0; // 墙钟时间上限 (ms)
+        int memLimit = 0;
+        int outputLimitKB = defaultOutputLimitKB; // 输出上限 (KB)
+        std::shared_ptr<const TestSet> tests;     // 数据驱动的测试用例(可为空)
+
+        // 中间状态与结果
+        std::string fileName;
+        int exeFd = -1; // 不落盘模式下的可执行程序
+        int statusCode = 0;
+        std::string compileError;
+        std::string stdoutVal;
+        std::string stderrVal;
+        long compileMs = -1; // 编译阶段耗时 (ms)，命中缓存时接近0，-1为未进入编译阶段
+        bool ran = false;    // 是否进入了运行阶段，为真时usage有效
+        RunUsage usage;
+        Json::Value testResults; // 每组测试用例的结果
+        int testsPassed = 0;
+
+        // 取消标记(选填)，置位后跳过尚未开始的阶段
+        std::shared_ptr<std::atomic<bool>> cancelled;
+
+        bool Cancelled() const
+        {
+            return cancelled && cancelled->load();
+        }
+    };
 
     class CompileAndRun
     {
@@ -22,10 +79,13 @@ namespace ns_compile_and_run
          * -2 系统将代码写入文件失败
          * -3 代码文件编译失败
          * -4 代码运行前失败
+         * -5 题目测试框架编译失败
+         * -6 任务已被取消
+         * -7 测试数据加载失败
          * =0 代码运行成功
          * >0 代码运行中出错，值为信号值
          */
-        static std::string CodeToDEsc(int code, const std::string &fileName)
+        static std::string CodeToDEsc(int code, const std::string &compileError)
         {
             std::string desc;
             switch (code)
@@ -40,14 +100,24 @@ namespace ns_compile_and_run
                 desc = "未知错误：-2";
                 break;
             case -3:
-                if(!FileUtil::ReadFile(PathUtil::BuildCompilerError(fileName), &desc, true))
-                {
-                    desc = "代码编译失败";
-                }
+                desc = compileError.empty() ? "代码编译失败" : compileError;
                 break;
             case -4:
                 desc = "未知错误：-4";
                 break;
+            case -5:
+                desc = "题目测试框架编译失败";
+                break;
+            case -6:
+                desc = "任务已取消";
+                break;
+            case -7:
+                desc = "测试数据加载失败";
+                break;
+            // -8为oj_server放弃判题时的状态码
+            case -9:
+                desc = "测试数据未缓存";
+                break;
             case SIGXCPU:
             case SIGALRM:
                 desc = "时间超出限制";
@@ -55,6 +125,9 @@ namespace ns_compile_and_run
             case SIGABRT:
                 desc = "内存超出限制";
                 break;
+            case SIGXFSZ:
+                desc = "输出超出限制";
+                break;
             case SIGKILL:
                 desc = "资源超出限制";
                 break;
@@ -75,7 +148,7 @@ namespace ns_compile_and_run
          */
         static void RemoveTempFile(const std::string &fileName)
         {
-            // cpp,compiler_error,stdin,stdout,stderr
+            // cpp,compiler_error,exe，程序的输入输出经管道传递，不再产生文件
             std::string _src = PathUtil::BuildSrc(fileName);
             if(FileUtil::IsFileExists(_src))
                 unlink(_src.c_str());
@@ -84,115 +157,420 @@ namespace ns_compile_and_run
             if(FileUtil::IsFileExists(_compiler_error))
                 unlink(_compiler_error.c_str());
 
-            std::string _stdin = PathUtil::BuildStdin(fileName);
-            if(FileUtil::IsFileExists(_stdin))
-                unlink(_stdin.c_str());
-
-            std::string _stdout = PathUtil::BuildStdout(fileName);
-            if(FileUtil::IsFileExists(_stdout))
-                unlink(_stdout.c_str());
-
-            std::string _stderr = PathUtil::BuildStderr(fileName);
-            if(FileUtil::IsFileExists(_stderr))
-                unlink(_stderr.c_str());
-
             std::string _exe = PathUtil::BuildExe(fileName);
             if(FileUtil::IsFileExists(_exe))
                 unlink(_exe.c_str());
         }
 
         /**
-         * @brief 
-         * 
-         * inJson：输入参数
-         * outJson：输出参数
+         * @brief 解析请求
          * 
          * 输入/inJson结构：
          *      code：用户提供的代码
          *      inout：用户自测样例(不处理)
-         *      cpuLimit：时间要求
+         *      cpuLimit：时间要求 (s)
+         *      cpuLimitMs：时间要求 (ms，选填)，存在时代替cpuLimit
+         *      wallLimitMs：墙钟时间要求 (ms，选填)，默认为时间要求的 wallLimitFactor 倍
          *      memLimit：空间要求
-         * 输出/outJson结构:
-         *      status：状态码
-         *      reason：状态码描述
-         *      stdout：程序运行完成的-*结果(选填)
-         *      stderr：程序运行失败的错误结果
+         *      outputLimitKB：标准输出与标准错误合计的上限 (KB，选填)，默认为 defaultOutputLimitKB
+         *      number：题目编号(选填)
+         *      harness：题目测试框架源码(选填)，按题号缓存为目标文件后与code链接
+         *      tests：测试用例(选填)，[{"input":输入, "output":期望输出}]，按 题号+版本 缓存为memfd
+         *      testsVersion：测试数据的版本(选填)，缓存命中时不需要tests，未命中且没有tests时code为-9，调用者应附带tests重新提交
+         *             程序对每组输入各运行一次，cpuLimitMs与wallLimitMs都是每组的限制
+         * return：代码为空、测试数据未缓存或加载失败时为假，job->statusCode已设置，不再进入编译阶段
          */
-        static void Start(const std::string &inJson, std::string *outJson)
+        static bool Parse(const std::string &inJson, Job *job)
         {
             // 输入字符串->结构化数据
             Json::Value inValue;
             Json::Reader reader;
             reader.parse(inJson, inValue);
-            std::string code = inValue["code"].asString();
-            std::string input = inValue["input"].asString();
-            int cpuLimit = inValue["cpuLimit"].asInt();
-            int memLimit = inValue["memLimit"].asInt();
+            return Parse(inValue, job);
+        }
 
-            // 输出结构
+        /**
+         * @brief 解析已反序列化的请求，批量请求中的每一项直接使用
+         * 
+         */
+        static bool Parse(const Json::Value &inValue, Job *job)
+        {
+            job->code = inValue["code"].asString();
+            job->input = inValue["input"].asString();
+            job->cpuLimitMs = inValue.isMember("cpuLimitMs") ? inValue["cpuLimitMs"].asInt() : inValue["cpuLimit"].asInt() * 1000;
+            if (inValue.isMember("wallLimitMs"))
+            {
+                job->wallLimitMs = inValue["wallLimitMs"].asInt();
+            }
+            else
+            {
+                job->wallLimitMs = job->cpuLimitMs > 0 ? job->cpuLimitMs * wallLimitFactor : defaultWallLimitMs;
+            }
+            job->memLimit = inValue["memLimit"].asInt();
+            if (inValue.isMember("outputLimitKB"))
+            {
+                job->outputLimitKB = inValue["outputLimitKB"].asInt();
+            }
+            job->number = inValue["number"].asString();
+            job->harness = inValue["harness"].asString();
+
+            if (job->code.empty())
+            {
+                // 用户提交的代码为空
+                job->statusCode = -1; // 代码为空
+                return false;
+            }
+            bool hasTests = inValue["tests"].isArray() && !inValue["tests"].empty();
+            std::string testsVersion = inValue["testsVersion"].asString();
+            if (hasTests || !testsVersion.empty())
+            {
+                job->tests = TestDataCache::GetInstance().Get(job->number, testsVersion, inValue["tests"]);
+                if (!job->tests)
+                {
+                    job->statusCode = hasTests ? -7 : -9; // 测试数据加载失败 / 测试数据未缓存
+                    return false;
+                }
+            }
+            // 形成唯一的文件名，无目录无后缀，毫秒级时间戳+原子性递增唯一值，后期可用uid
+            job->fileName = FileUtil::UniqFileName();
+            return true;
+        }
+
+        /**
+         * @brief 编译阶段，耗时写入job->compileMs
+         * return：得到可执行程序时为真，需要进入运行阶段；否则job->statusCode已设置
+         */
+        static bool CompileStage(Job *job)
+        {
+            auto start = std::chrono::steady_clock::now();
+            bool ok = Compile(job);
+            job->compileMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            return ok;
+        }
+
+        /**
+         * @brief 运行阶段，启动程序后立即返回，结果写入job->statusCode，资源使用写入job->usage
+         * post：程序结束后的处理(比对输出、启动下一组用例)经post交给其他线程，不占用Supervisor的监控线程
+         * done：运行阶段结束后调用，调用者需保证job在此之前有效
+         */
+        static void RunStage(Job *job, const Executor &post, const std::function<void()> &done)
+        {
+            job->ran = true;
+            if (job->tests)
+            {
+                job->statusCode = 0;
+                job->testResults = Json::Value(Json::arrayValue);
+                RunCase(job, 0, post, done);
+                return;
+            }
+            RunOnce(job, job->wallLimitMs, job->outputLimitKB, -1, [job, post, done](RunOutcome &outcome)
+                    {
+                        if (outcome.code < 0)
+                        {
+                            // 内部错误
+                            job->statusCode = -4; // 未运行失败，内部错误
+                        }
+                        else
+                        {
+                            // 运行失败时为信号值，运行完成时为0
+                            job->statusCode = outcome.code;
+                        }
+                        job->stdoutVal = std::move(outcome.out);
+                        job->stderrVal = std::move(outcome.err);
+                        job->usage = outcome.usage;
+                        post(done);
+                    });
+        }
+
+        /**
+         * @brief 生成结果并清理临时文件
+         * 
+         * 输出/outJson结构:
+         *      status：状态码
+         *      reason：状态码描述
+         *      stdout：程序运行完成的-*结果(选填)
+         *      stderr：程序的错误输出，程序运行过时才有，运行失败时为出错的那次运行的错误输出
+         *      outputTruncated：输出超出上限，stdout/stderr只有前面的部分(选填)
+         *      tests：每组测试用例的结果(选填)，[{"passed","code","reason","cpuMs","wallMs","peakRssKB"}]
+         *             code非0时stderr为该组的错误结果，之后的用例不再运行
+         *      testsPassed/testsTotal：通过的用例数与用例总数(选填)
+         *      compileMs：编译阶段耗时 (ms，选填)
+         *      cpuMs/wallMs/peakRssKB/outputBytes：程序的CPU时间、墙钟时间 (ms)、内存峰值 (KB)与输出字节数，程序运行过时才有
+         *             有测试用例时为各组的合计，内存峰值为各组的最大值
+         */
+        static void Finish(Job *job, std::string *outJson)
+        {
             Json::Value outValue;
+            Finish(job, &outValue);
+            Json::StyledWriter writer;
+            *outJson = writer.write(outValue);
+        }
 
-            int statusCode;
-            std::string fileName;
-            int runRetVal;
+        /**
+         * @brief 生成结构化的结果并清理临时文件，批量请求直接放入结果数组
+         * 
+         */
+        static void Finish(Job *job, Json::Value *outValue)
+        {
+            bool diskless = Diskless();
+            // 输出结构
+            (*outValue)["code"] = job->statusCode;
+            (*outValue)["reason"] = CodeToDEsc(job->statusCode, job->compileError);
 
-            if (code.empty())
+            if (0 == job->statusCode || SIGXFSZ == job->statusCode)
             {
-                // 用户提交的代码为空
-                statusCode = -1; // 代码为空
-                goto END;
+                // 代码运行成功有结果，输出超出上限时返回截断后的部分
+                (*outValue)["stdout"] = job->stdoutVal;
+            }
+            if (job->ran)
+            {
+                // 运行出错时stderr是排查错误的依据，同样返回
+                (*outValue)["stderr"] = job->stderrVal;
+            }
+            if (SIGXFSZ == job->statusCode)
+            {
+                (*outValue)["outputTruncated"] = true;
+            }
+            if (job->tests && job->ran)
+            {
+                (*outValue)["tests"] = job->testResults;
+                (*outValue)["testsPassed"] = job->testsPassed;
+                (*outValue)["testsTotal"] = (Json::UInt)job->tests->Size();
+            }
+            if (job->compileMs >= 0)
+            {
+                (*outValue)["compileMs"] = (Json::Int64)job->compileMs;
+            }
+            if (job->ran)
+            {
+                (*outValue)["cpuMs"] = (Json::Int64)job->usage.cpuMs;
+                (*outValue)["wallMs"] = (Json::Int64)job->usage.wallMs;
+                (*outValue)["peakRssKB"] = (Json::Int64)job->usage.peakRssKB;
+                (*outValue)["outputBytes"] = (Json::Int64)job->usage.outputBytes;
+            }
+
+            if (job->exeFd >= 0)
+            {
+                close(job->exeFd);
+                job->exeFd = -1;
+            }
+            if (!diskless && !job->fileName.empty())
+            {
+                RemoveTempFile(job->fileName);
+            }
+        }
+
+        /**
+         * @brief 在当前线程中依次完成解析、编译、运行
+         * 
+         * inJson：输入参数，结构见Parse
+         * outJson：输出参数，结构见Finish
+         */
+        static void Start(const std::string &inJson, std::string *outJson)
+        {
+            Job job;
+            if (Parse(inJson, &job) && CompileStage(&job))
+            {
+                // 程序结束后的处理交回本线程依次执行
+                std::deque<std::function<void()>> tasks;
+                std::mutex mtx;
+                std::condition_variable cond;
+                bool finished = false;
+                Executor post = [&](const std::function<void()> &task)
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    tasks.push_back(task);
+                    cond.notify_one();
+                };
+                RunStage(&job, post, [&finished]
+                         { finished = true; });
+
+                std::unique_lock<std::mutex> lock(mtx);
+                while (!finished)
+                {
+                    cond.wait(lock, [&tasks]
+                              { return !tasks.empty(); });
+                    std::function<void()> task = std::move(tasks.front());
+                    tasks.pop_front();
+                    lock.unlock();
+                    task();
+                    lock.lock();
+                }
+            }
+            Finish(&job, outJson);
+        }
+
+        /**
+         * @brief 设置不落盘模式，服务启动时、处理请求之前调用
+         * 源代码经管道交给g++，可执行程序保存在memfd中，不在./temp/下产生文件
+         */
+        static void SetDiskless(bool diskless)
+        {
+            Diskless() = diskless;
+        }
+
+    private:
+        /**
+         * @brief 复用缓存或编译得到可执行程序，返回值同CompileStage
+         *
+         */
+        static bool Compile(Job *job)
+        {
+            bool diskless = Diskless();
+            std::shared_ptr<const std::string> harness; // 链接完成之前持有，测试框架更新时旧的目标文件不会被提前删除
+            std::string harnessObj;
+            // 编译，相同的代码与编译选项直接复用缓存的可执行程序
+            std::string cacheKey = CompileCache::BuildKey(job->code, job->harness, Compiler::CompileFlags());
+            bool hit = diskless ? CompileCache::GetInstance().LookupFd(cacheKey, &job->exeFd)
+                                : CompileCache::GetInstance().Lookup(cacheKey, job->fileName);
+            if (hit)
+            {
+                return true;
+            }
+            // 测试框架只在首次或版本变化时编译，之后只编译用户代码再链接
+            if (!job->harness.empty() && !HarnessCache::GetInstance().Get(job->number, job->harness, &harness))
+            {
+                job->statusCode = -5; // 测试框架编译失败，内部错误
+                return false;
+            }
+            if (harness)
+            {
+                harnessObj = *harness;
+            }
+            if (diskless)
+            {
+                if (!Compiler::CompileInMemory(job->code, harnessObj, &job->exeFd, &job->compileError))
+                {
+                    job->statusCode = -3; // 代码编译失败
+                    return false;
+                }
+                CompileCache::GetInstance().InsertFd(cacheKey, job->exeFd);
+                return true;
             }
             // 将code写到临时源文件中
-            // 形成唯一的文件名，无目录无后缀，毫秒级时间戳+原子性递增唯一值，后期可用uid
-            fileName = FileUtil::UniqFileName();
-            if (!FileUtil::WriteFile(PathUtil::BuildSrc(fileName), code))
+            if (!FileUtil::WriteFile(PathUtil::BuildSrc(job->fileName), job->code))
             {
                 // 写入失败
-                statusCode = -2; // 代码写入文件中失败
-                goto END;
+                job->statusCode = -2; // 代码写入文件中失败
+                return false;
             }
-            // 编译
-            if (!Compiler::Compile(fileName))
+            if (!Compiler::Compile(job->fileName, harnessObj))
             {
                 // 编译失败
-                statusCode = -3; // 代码编译失败，内部错误
-                goto END;
-            }
-            runRetVal = Runner::Run(fileName, cpuLimit, memLimit);
-            if (runRetVal < 0)
-            {
-                // 内部错误
-                statusCode = -4; // 未运行失败，内部错误
+                FileUtil::ReadFile(PathUtil::BuildCompilerError(job->fileName), &job->compileError, true);
+                job->statusCode = -3; // 代码编译失败，内部错误
+                return false;
             }
-            else if (runRetVal > 0)
+            CompileCache::GetInstance().Insert(cacheKey, job->fileName);
+            return true;
+        }
+
+        /**
+         * @brief 启动一次程序，结果同Runner::Run
+         *
+         */
+        static void RunOnce(Job *job, int wallLimitMs, int outputLimitKB, int inFd, const RunCallback &done)
+        {
+            if (Diskless())
             {
-                // 运行失败
-                statusCode = runRetVal; // 代码运行时失败
+                Runner::RunInMemory(job->exeFd, job->cpuLimitMs, wallLimitMs, job->memLimit, outputLimitKB, inFd, done);
             }
             else
             {
-                // 运行成功
-                statusCode = 0; // 代码运行完成
+                Runner::Run(job->fileName, job->cpuLimitMs, wallLimitMs, job->memLimit, outputLimitKB, inFd, done);
             }
-        END:
-            outValue["code"] = statusCode;
-            outValue["reason"] = CodeToDEsc(statusCode, fileName);
+        }
 
-            if (0 == statusCode)
+        /**
+         * @brief 以第i组测试输入运行程序，结束后经post比对期望输出，再启动下一组
+         * 答案错误时继续运行之后的用例；运行出错、超时时job->statusCode为该组的结果，不再运行之后的用例
+         * 墙钟时间按组限制，oj_server的等待时间按用例数放大
+         */
+        static void RunCase(Job *job, size_t i, const Executor &post, const std::function<void()> &done)
+        {
+            const TestSet &tests = *job->tests;
+            if (i >= tests.Size())
             {
-                // 代码运行成功有结果
-                std::string stdoutVal;
-                std::string stderrVal;
-                FileUtil::ReadFile(PathUtil::BuildStdout(fileName), &stdoutVal, true);
-                FileUtil::ReadFile(PathUtil::BuildStderr(fileName), &stderrVal, true);
-                outValue["stdout"] = stdoutVal;
-                outValue["stderr"] = stderrVal;
+                done();
+                return;
             }
+            if (job->Cancelled())
+            {
+                job->statusCode = -6; // 任务已被取消
+                done();
+                return;
+            }
+            // 期望输出较大的压力测试，输出上限至少为期望输出的两倍
+            int outputLimitKB = std::max<long>(job->outputLimitKB, tests.Expect(i).size() / 1024 * 2 + 1);
+            auto next = [job, i, post, done](RunOutcome &outcome)
+            {
+                std::shared_ptr<RunOutcome> result = std::make_shared<RunOutcome>(std::move(outcome));
+                post([job, i, post, done, result]
+                     {
+                         if (RecordCase(job, i, result.get()))
+                         {
+                             RunCase(job, i + 1, post, done);
+                         }
+                         else
+                         {
+                             done();
+                         }
+                     });
+            };
+            int inFd = tests.OpenInput(i);
+            if (inFd < 0)
+            {
+                RunOutcome outcome;
+                outcome.code = -1;
+                next(outcome);
+                return;
+            }
+            RunOnce(job, job->wallLimitMs, outputLimitKB, inFd, next);
+            close(inFd);
+        }
 
-            Json::StyledWriter writer;
-            *outJson = writer.write(outValue);
+        /**
+         * @brief 记录第i组用例的结果
+         * return：为真时继续运行之后的用例
+         */
+        static bool RecordCase(Job *job, size_t i, RunOutcome *outcome)
+        {
+            const TestSet &tests = *job->tests;
+            const RunUsage &usage = outcome->usage;
+            job->usage.cpuMs += usage.cpuMs;
+            job->usage.wallMs += usage.wallMs;
+            job->usage.peakRssKB = std::max(job->usage.peakRssKB, usage.peakRssKB);
+            job->usage.outputBytes += usage.outputBytes;
+
+            Json::Value result;
+            int code = outcome->code < 0 ? -4 : outcome->code;
+            result["passed"] = 0 == code && TestSet::Match(outcome->out, tests.Expect(i));
+            result["code"] = code;
+            if (0 != code)
+            {
+                result["reason"] = CodeToDEsc(code, "");
+            }
+            result["cpuMs"] = (Json::Int64)usage.cpuMs;
+            result["wallMs"] = (Json::Int64)usage.wallMs;
+            result["peakRssKB"] = (Json::Int64)usage.peakRssKB;
+            job->testResults.append(result);
+            if (result["passed"].asBool())
+            {
+                job->testsPassed++;
+            }
+            if (0 != code)
+            {
+                job->statusCode = code;
+                job->stderrVal = std::move(outcome->err);
+                return false;
+            }
+            return true;
+        }
 
-            RemoveTempFile(fileName);
+        static bool &Diskless()
+        {
+            static bool diskless = false;
+            return diskless;
         }
     };
 
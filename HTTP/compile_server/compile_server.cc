@@ -1,28 +1,145 @@
 #include "./compile_run.hpp"
+#include "./pipeline.hpp"
+#include "./job_store.hpp"
+#include "./puller.hpp"
 #include "../comm/httplib.h"
 
 #include <iostream>
 #include <string>
+#include <future>
 
 using namespace ns_compile_and_run;
+using namespace ns_pipeline;
+using namespace ns_job_store;
+using namespace ns_puller;
 using namespace httplib;
 
+const Json::ArrayIndex batchMaxJobs = 1024; // 单个批量请求最多包含的任务数
+
 void Usage(std::string proc)
 {
     std::cerr << "Usage: "
-              << "\n\t" << proc << " port" << std::endl;
+              << "\n\t" << proc << " port [--diskless] [--spawn=vfork|fork] [--zygote=N]"
+              << " [--compile-workers=N] [--run-workers=N] [--max-runs=N] [--compile-queue=N] [--run-queue=N]"
+              << " [--pull=ip:port] [--pull-slots=N] [--pull-token=TOKEN] [--cgroup=DIR]"
+              << "\n\t--diskless: 编译运行全程不落盘(管道+memfd)"
+              << "\n\t--spawn: 创建子进程的方式，默认vfork"
+              << "\n\t--zygote: 运行进程池预先创建的子进程数，默认4，0为不使用进程池"
+              << "\n\t--compile-workers/--run-workers: 编译/运行线程数，默认按CPU核数与可用内存计算，运行线程只负责启动程序"
+              << "\n\t--max-runs: 同时运行的程序数，默认为CPU核数，与运行线程数无关"
+              << "\n\t--compile-queue/--run-queue: 编译/运行队列长度，编译队列满时返回503"
+              << "\n\t--pull: 从该oj_server(--dispatch=pull)的内部地址(--pull-listen)领取判题任务，同时仍接受推送的请求"
+              << "\n\t--pull-slots: 同时领取的任务数，默认为编译线程数与同时运行的程序数之和"
+              << "\n\t--pull-token: 领取任务时携带的共享密钥，与oj_server的--pull-token一致"
+              << "\n\t--cgroup: 用该cgroup v2目录隔离每次运行(memory/pids/cpu)，不可用时仍使用rlimit" << std::endl;
 }
 
-// 外界提供端口 ./compile_server port
+// 外界提供端口 ./compile_server port [选项]
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    if (argc < 2)
     {
         Usage(argv[0]);
         return -1;
     }
+    int zygotePoolSize = 4;
+    PipelineOptions pipelineOpt;
+    std::string pullHost;
+    int pullPort = 0;
+    size_t pullSlots = 0;
+    std::string pullToken;
+    std::string cgroupRoot;
+    for (int i = 2; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (opt == "--diskless")
+        {
+            CompileAndRun::SetDiskless(true);
+        }
+        else if (opt == "--spawn=vfork")
+        {
+            Spawner::SetMode(SpawnMode::VFork);
+        }
+        else if (opt == "--spawn=fork")
+        {
+            Spawner::SetMode(SpawnMode::Fork);
+        }
+        else if (opt.compare(0, 9, "--zygote=") == 0)
+        {
+            zygotePoolSize = atoi(opt.c_str() + 9);
+        }
+        else if (opt.compare(0, 18, "--compile-workers=") == 0)
+        {
+            pipelineOpt.compileWorkers = atoi(opt.c_str() + 18);
+        }
+        else if (opt.compare(0, 14, "--run-workers=") == 0)
+        {
+            pipelineOpt.runWorkers = atoi(opt.c_str() + 14);
+        }
+        else if (opt.compare(0, 11, "--max-runs=") == 0)
+        {
+            pipelineOpt.maxRuns = atoi(opt.c_str() + 11);
+        }
+        else if (opt.compare(0, 16, "--compile-queue=") == 0)
+        {
+            pipelineOpt.compileQueue = atoi(opt.c_str() + 16);
+        }
+        else if (opt.compare(0, 12, "--run-queue=") == 0)
+        {
+            pipelineOpt.runQueue = atoi(opt.c_str() + 12);
+        }
+        else if (opt.compare(0, 7, "--pull=") == 0 && opt.find(':', 7) != std::string::npos)
+        {
+            size_t colon = opt.find(':', 7);
+            pullHost = opt.substr(7, colon - 7);
+            pullPort = atoi(opt.c_str() + colon + 1);
+        }
+        else if (opt.compare(0, 9, "--cgroup=") == 0)
+        {
+            cgroupRoot = opt.substr(9);
+        }
+        else if (opt.compare(0, 13, "--pull-slots=") == 0)
+        {
+            pullSlots = atoi(opt.c_str() + 13);
+        }
+        else if (opt.compare(0, 13, "--pull-token=") == 0)
+        {
+            pullToken = opt.substr(13);
+        }
+        else
+        {
+            Usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // cgroup资源隔离，服务可能被移入子cgroup，必须在启动zygote之前
+    if (!cgroupRoot.empty())
+    {
+        CgroupPool::GetInstance().Init(cgroupRoot);
+    }
+
+    // 运行进程池，必须在创建任何线程之前启动
+    Zygote::Start(zygotePoolSize);
+
+    // 构建公共前置代码的预编译头，失败时按原方式编译
+    Compiler::InitPrecompiledHeader();
+
+    // 编译、运行两个阶段的线程池
+    Pipeline::GetInstance().Init(pipelineOpt);
+
+    // 拉取模式：空闲时向oj_server领取判题任务
+    if (!pullHost.empty())
+    {
+        Puller::Start(pullHost, pullPort, pullSlots, pullToken);
+    }
 
     Server svr;
+    // http线程只负责等待流水线的结果，数量多于流水线容量，使超出容量的请求能及时得到503
+    // 流水线中的每个任务最多对应一个同步请求或一个长轮询
+    size_t httpThreads = std::max<size_t>(CPPHTTPLIB_THREAD_POOL_COUNT, Pipeline::GetInstance().Capacity() * 2 + 1);
+    svr.new_task_queue = [httpThreads]
+    { return new ThreadPool(httpThreads); };
 
     // svr.set_base_dir("./wwwroot");
     // set_keep_alive(false); // 关闭长连接，客户端进行关闭
@@ -32,14 +149,130 @@ int main(int argc, char *argv[])
                  // 正文：inJson
                  // 结果: outJson
                  std::string inJson = req.body;
-                 std::string outJson;
                  if (!inJson.empty())
                  {
-                     CompileAndRun::Start(inJson, &outJson);
-                     resp.set_content(outJson, "application/json; charset=utf-8");
+                     // 交给流水线，当前线程等待结果
+                     auto result = std::make_shared<std::promise<std::string>>();
+                     std::future<std::string> outJson = result->get_future();
+                     if (!Pipeline::GetInstance().Submit(inJson, [result](const std::string &out)
+                                                         { result->set_value(out); }))
+                     {
+                         // 编译队列已满，由oj_server选择其他主机
+                         LOG(WARNING) << "编译队列已满，拒绝请求" << std::endl;
+                         resp.status = 503;
+                         return;
+                     }
+                     resp.set_content(outJson.get(), "application/json; charset=utf-8");
                  }
              });
 
+    // 负载上报：流水线中执行/排队的请求数与节点的CPU、内存情况(含内存总量)，oj_server据此选择主机
+    svr.Get("/load", [](const Request &, Response &resp)
+            {
+                Pipeline &pipeline = Pipeline::GetInstance();
+                Json::Value loadValue;
+                loadValue["running"] = (Json::UInt64)pipeline.Running();
+                loadValue["queued"] = (Json::UInt64)pipeline.Queued();
+                loadValue["compileRunning"] = (Json::UInt64)pipeline.CompilePool().Busy();
+                loadValue["compileQueued"] = (Json::UInt64)pipeline.CompilePool().Queued();
+                loadValue["runRunning"] = (Json::UInt64)pipeline.RunJobs();
+                loadValue["runQueued"] = (Json::UInt64)pipeline.RunPool().Queued();
+                loadValue["cores"] = SysUtil::CpuCores();
+                loadValue["loadavg"] = SysUtil::LoadAvg();
+                loadValue["memAvailableKB"] = (Json::Int64)SysUtil::MemAvailableKB();
+                loadValue["memTotalKB"] = (Json::Int64)SysUtil::MemTotalKB();
+                Json::FastWriter writer;
+                resp.set_content(writer.write(loadValue), "application/json; charset=utf-8");
+            });
+
+    // 批量编译运行：正文为请求数组，每一项与/compile_and_run的正文相同，返回对应的结果数组
+    svr.Post("/compile_and_run_batch", [](const Request &req, Response &resp)
+             {
+                 Json::Value inArray;
+                 Json::Reader reader;
+                 if (!reader.parse(req.body, inArray) || !inArray.isArray())
+                 {
+                     resp.status = 400;
+                     return;
+                 }
+                 if (inArray.size() > batchMaxJobs)
+                 {
+                     resp.status = 413;
+                     return;
+                 }
+                 for (const auto &item : inArray)
+                 {
+                     if (!item.isObject())
+                     {
+                         resp.status = 400;
+                         return;
+                     }
+                 }
+                 Json::Value outArray;
+                 Pipeline::GetInstance().SubmitBatch(inArray, &outArray);
+                 Json::FastWriter writer;
+                 resp.set_content(writer.write(outArray), "application/json; charset=utf-8");
+             });
+
+    // 异步提交：正文与/compile_and_run相同，立即返回任务id
+    svr.Post("/jobs", [](const Request &req, Response &resp)
+             {
+                 if (req.body.empty())
+                 {
+                     resp.status = 400;
+                     return;
+                 }
+                 std::string id;
+                 std::shared_ptr<std::atomic<bool>> cancelled;
+                 if (!JobStore::GetInstance().Create(&id, &cancelled))
+                 {
+                     LOG(WARNING) << "任务存储已满，拒绝请求" << std::endl;
+                     resp.status = 503;
+                     return;
+                 }
+                 if (!Pipeline::GetInstance().Submit(req.body, [id](const std::string &out)
+                                                     { JobStore::GetInstance().Complete(id, out); },
+                                                     cancelled))
+                 {
+                     JobStore::GetInstance().Remove(id);
+                     LOG(WARNING) << "编译队列已满，拒绝请求" << std::endl;
+                     resp.status = 503;
+                     return;
+                 }
+                 Json::Value idValue;
+                 idValue["id"] = id;
+                 Json::FastWriter writer;
+                 resp.status = 202;
+                 resp.set_content(writer.write(idValue), "application/json; charset=utf-8");
+             });
+
+    // 查询结果：?wait=ms 时长轮询，完成返回200与outJson，未完成返回202，不存在或已过期返回404
+    svr.Get(R"(/jobs/([0-9.]+))", [](const Request &req, Response &resp)
+            {
+                std::string id = req.matches[1];
+                int waitMs = req.has_param("wait") ? atoi(req.get_param_value("wait").c_str()) : 0;
+                std::string outJson;
+                switch (JobStore::GetInstance().Get(id, waitMs, &outJson))
+                {
+                case JobState::Done:
+                    resp.set_content(outJson, "application/json; charset=utf-8");
+                    break;
+                case JobState::Pending:
+                    resp.status = 202;
+                    break;
+                default:
+                    resp.status = 404;
+                    break;
+                }
+            });
+
+    // 取消任务：oj_server的对冲请求有一方返回后，取消另一方，尚未开始的编译/运行阶段不再执行
+    svr.Delete(R"(/jobs/([0-9.]+))", [](const Request &req, Response &resp)
+               {
+                   std::string id = req.matches[1];
+                   resp.status = JobStore::GetInstance().Cancel(id) ? 204 : 404;
+               });
+
     LOG(INFO) << "编译服务启动成功，端口号为：" << argv[1] << std::endl;
     svr.listen("0.0.0.0", atoi(argv[1])); // 启动http服务
 
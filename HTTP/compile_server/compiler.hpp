@@ -6,82 +6,255 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "../comm/util.hpp"
 #include "../comm/log.hpp"
+#include "./spawner.hpp"
 
 namespace ns_compiler {
 
     using namespace ns_util; // 引入路径拼接
     using namespace ns_log; // 日志
+    using namespace ns_spawner; // 创建子进程
+
+    const std::string pchDirPath = temp_path + "pch/"; // 预编译头所在目录
 
     class Compiler {
         public:
             Compiler() {}
             ~Compiler() {}
+
+            /*
+            * 编译选项，除源文件与目标文件外的全部g++参数
+            * 编译缓存的键包含这些选项，修改选项后旧的缓存自然失效
+            * 预编译头构建成功后，会追加 -include 选项
+            * 
+            * COMPILER_ONLINE 传入宏用于取消包含头文件
+            * -Werror=return-type 强制代码存在return语句,否则报错
+            * -Wfatal-errors 当遇到错误时，停止编译，避免泄露不必要的信息
+            */
+            static const std::vector<std::string> &CompileFlags() {
+                return Flags();
+            }
+
+            /*
+            * 构建预编译头，服务启动时、处理请求之前调用一次
+            * 公共前置代码(测试用例与题解常用的标准头文件)只解析一次，
+            * 之后的每次编译通过 -include 复用 prelude.hpp.gch
+            * 构建失败时不追加选项，编译行为与之前一致
+            */
+            static bool InitPrecompiledHeader() {
+                mkdir(pchDirPath.c_str(), 0755);
+                std::string header = pchDirPath + "prelude.hpp";
+                std::string src;
+                for(const auto &h : PreludeHeaders()) {
+                    src += "#include <" + h + ">\n";
+                }
+                if(!FileUtil::WriteFile(header, src)) {
+                    LOG(WARNING) << "写入预编译头源文件失败" << "\n";
+                    return false;
+                }
+
+                // 预编译头必须使用与用户代码相同的编译选项
+                std::vector<std::string> args = {"g++", "-x", "c++-header", header, "-o", header + ".gch"};
+                const std::vector<std::string> &flags = CompileFlags();
+                args.insert(args.end(), flags.begin(), flags.end());
+                if(0 != Exec(args, pchDirPath + "prelude.compiler_error")) {
+                    LOG(WARNING) << "构建预编译头失败，不使用预编译头" << "\n";
+                    return false;
+                }
+
+                Flags().push_back("-include");
+                Flags().push_back(header);
+                LOG(INFO) << "构建预编译头成功：" << header << ".gch" << "\n";
+                return true;
+            }
+
             /*
             * 输入参数：
             *   codeFile：需要编译的文件的文件名
+            *   harnessObj：已编译好的测试框架目标文件，与用户代码一起链接，可为空
             * 返回值：
             *   true：编译成功
             *   false：编译失败
             * 
             */
-            static bool Compile(const std::string &fileName) {
+            static bool Compile(const std::string &fileName, const std::string &harnessObj = "") {
 
-                // 创建子进程，进行程序替换，提供编译功能
-                pid_t childPid = fork();
-                if(childPid < 0) { // 失败
-                    LOG(ERROR) << "创建子进程失败" << "\n";
-
-                } else if(childPid == 0) { // 子进程
+                // g++ -o target src [harness.o] [编译选项]
+                std::vector<std::string> args = {"g++", "-o", PathUtil::BuildExe(fileName), PathUtil::BuildSrc(fileName)};
+                if(!harnessObj.empty()) {
+                    args.push_back(harnessObj);
+                }
+                const std::vector<std::string> &flags = CompileFlags();
+                args.insert(args.end(), flags.begin(), flags.end());
+                Exec(args, PathUtil::BuildCompilerError(fileName));
 
-                    // 将标准错误重定向到_stderr
-                    umask(0);
-                    int fdStderr = open(PathUtil::BuildCompilerError(fileName).c_str(), O_CREAT | O_WRONLY, 0644);
-                    if(fdStderr < 0) {
-                        LOG(WARNING) << "生成compiler_error文件失败" << "\n";
-                        exit(1); // 生成失败会导致run时打开失败
-                    }
-                    dup2(fdStderr, 2); // 重定向
-
-                    // g++ -o target src -std=c++11
-                    // COMPILER_ONLINE 传入宏用于取消包含头文件
-                    // -Werror=return-type 强制代码存在return语句,否则报错
-                    // -Wfatal-errors 当遇到错误时，停止编译，避免泄露不必要的信息
-                    execlp("g++", \
-                    "g++", \
-                     "-o",  \
-                     PathUtil::BuildExe(fileName).c_str(), \
-                     PathUtil::BuildSrc(fileName).c_str(), \
-                     "-D", \
-                     "COMPILER_ONLINE", \
-                     "-Werror=return-type", \
-                     "-Wfatal-errors", \
-                     "-std=c++11", \
-                     nullptr);
-                    
-                    LOG(ERROR) << "启动g++失败，请注意相关参数" << "\n";
-                    exit(2); // 程序替换失，没有生成可执行程序
-                } else { // 父进程
-                    waitpid(childPid, nullptr, 0);
-
-                    // 如果编译成功了，则可执行程序是能够打开的，stat
-                    // 或者通过获取子进程/g++的返回值，判断是否编译成功，进程通信
-                    if(FileUtil::IsFileExists(PathUtil::BuildExe(fileName))) {
-                        LOG(INFO) << "编译成功：" << PathUtil::BuildSrc(fileName) << "\n";
-                        return true;
-                    }
+                // 如果编译成功了，则可执行程序是能够打开的，stat
+                // 或者通过获取子进程/g++的返回值，判断是否编译成功，进程通信
+                if(FileUtil::IsFileExists(PathUtil::BuildExe(fileName))) {
+                    LOG(INFO) << "编译成功：" << PathUtil::BuildSrc(fileName) << "\n";
+                    return true;
                 }
 
                 LOG("ERROR") << "编译失败" << std::endl;
                 return false;
             }
+
+            /*
+            * 不落盘编译：源代码通过管道写入g++的标准输入，可执行程序输出到memfd
+            * 输入参数：
+            *   code：需要编译的源代码
+            *   harnessObj：已编译好的测试框架目标文件，可为空
+            * 输出参数：
+            *   exeFd：只读打开的可执行程序，调用者负责关闭
+            *   err：编译错误信息
+            * 
+            * g++的中间文件(.s/.o)通过 -pipe 与 TMPDIR=/dev/shm 留在内存中
+            */
+            static bool CompileInMemory(const std::string &code, const std::string &harnessObj, int *exeFd, std::string *err) {
+                int memFd = memfd_create("exe", MFD_CLOEXEC);
+                if(memFd < 0) {
+                    LOG(ERROR) << "创建memfd失败" << "\n";
+                    return false;
+                }
+
+                // 子进程通过本进程的fd路径打开memfd，链接器会重新打开输出文件，不能使用/proc/self
+                std::string exePath = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(memFd);
+                std::vector<std::string> args = {"g++", "-pipe", "-o", exePath};
+                const std::vector<std::string> &flags = CompileFlags();
+                args.insert(args.end(), flags.begin(), flags.end());
+                args.insert(args.end(), {"-x", "c++", "-"});
+                if(!harnessObj.empty()) {
+                    args.insert(args.end(), {"-x", "none", harnessObj});
+                }
+
+                std::vector<std::string> envs;
+                for(char **env = environ; *env; ++env) {
+                    if(0 != strncmp(*env, "TMPDIR=", 7)) {
+                        envs.push_back(*env);
+                    }
+                }
+                if(FileUtil::IsFileExists("/dev/shm")) {
+                    envs.push_back("TMPDIR=/dev/shm");
+                }
+
+                int inPipe[2], errPipe[2];
+                if(0 != pipe2(inPipe, O_CLOEXEC)) {
+                    close(memFd);
+                    return false;
+                }
+                if(0 != pipe2(errPipe, O_CLOEXEC)) {
+                    close(inPipe[0]);
+                    close(inPipe[1]);
+                    close(memFd);
+                    return false;
+                }
+
+                SpawnOptions opt;
+                opt.args = args;
+                opt.envs = envs;
+                opt.redirects = {{inPipe[0], 0}, {errPipe[1], 2}};
+                pid_t childPid = Spawner::Spawn(opt);
+                close(inPipe[0]);
+                close(errPipe[1]);
+                if(childPid < 0) {
+                    LOG(ERROR) << "启动g++失败" << "\n";
+                    close(inPipe[1]);
+                    close(errPipe[0]);
+                    close(memFd);
+                    return false;
+                }
+                int status = PipeUtil::Communicate(childPid, inPipe[1], code, -1, nullptr, errPipe[0], err);
+
+                struct stat st;
+                if(!WIFEXITED(status) || 0 != WEXITSTATUS(status) || 0 != fstat(memFd, &st) || 0 == st.st_size) {
+                    close(memFd);
+                    LOG(INFO) << "编译失败" << std::endl;
+                    return false;
+                }
+
+                // 以可写方式打开的文件无法执行(ETXTBSY)，重新以只读方式打开
+                *exeFd = open(("/proc/self/fd/" + std::to_string(memFd)).c_str(), O_RDONLY | O_CLOEXEC);
+                close(memFd);
+                if(*exeFd < 0) {
+                    LOG(ERROR) << "重新打开memfd失败" << "\n";
+                    return false;
+                }
+                LOG(INFO) << "编译成功(内存)" << "\n";
+                return true;
+            }
+
+            /*
+            * 只编译不链接，生成目标文件 obj
+            * 编译错误信息写入 errFile
+            */
+            static bool CompileObject(const std::string &src, const std::string &obj, const std::string &errFile) {
+                std::vector<std::string> args = {"g++", "-c", "-o", obj, src};
+                const std::vector<std::string> &flags = CompileFlags();
+                args.insert(args.end(), flags.begin(), flags.end());
+                return 0 == Exec(args, errFile) && FileUtil::IsFileExists(obj);
+            }
         private:
+            static std::vector<std::string> &Flags() {
+                static std::vector<std::string> flags = {
+                    "-D", "COMPILER_ONLINE",
+                    "-Werror=return-type",
+                    "-Wfatal-errors",
+                    "-std=c++11"
+                };
+                return flags;
+            }
+
+            /*
+            * 预编译头包含的标准头文件，即测试用例与常见题解的公共前置部分
+            * 预编译头在用户代码之前被包含，只放C++标准头文件：POSIX头文件(unistd.h等)中的link、dup、pipe、alarm等名字
+            * 会与用户代码中的同名全局变量冲突，仍由测试用例在用户代码之后包含
+            */
+            static const std::vector<std::string> &PreludeHeaders() {
+                static const std::vector<std::string> headers = {
+                    "iostream", "string", "vector", "algorithm", "utility",
+                    "map", "unordered_map", "set", "unordered_set",
+                    "queue", "stack", "deque", "list",
+                    "cmath", "cstring", "climits", "functional", "numeric", "sstream"
+                };
+                return headers;
+            }
+
+            /*
+            * 创建子进程执行g++，标准错误重定向到 errFile
+            * 返回值：g++的退出码，失败时为-1
+            */
+            static int Exec(const std::vector<std::string> &args, const std::string &errFile) {
+                // 将标准错误重定向到errFile
+                int fdStderr = open(errFile.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+                if(fdStderr < 0) {
+                    LOG(WARNING) << "生成compiler_error文件失败" << "\n";
+                    return -1;
+                }
+
+                SpawnOptions opt;
+                opt.args = args;
+                opt.redirects = {{fdStderr, 2}};
+                pid_t childPid = Spawner::Spawn(opt);
+                close(fdStderr);
+                if(childPid < 0) {
+                    LOG(ERROR) << "启动g++失败，请注意相关参数" << "\n";
+                    return -1;
+                }
+
+                int status = 0;
+                waitpid(childPid, &status, 0);
+                return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            }
     };
 }
\ No newline at end of file
@@ -0,0 +1,152 @@
+/*
+* 测试框架缓存模块
+* 题目的测试框架(questions/N/harness.cpp)按 题号+版本 只编译一次，生成目标文件
+* 之后的提交只编译用户代码，再与目标文件链接
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+#include "./compiler.hpp"
+
+namespace ns_harness_cache
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_compiler;
+
+    const std::string harnessDirPath = "./temp/harness/"; // 测试框架目标文件所在目录
+
+    class HarnessCache
+    {
+    private:
+        struct Entry
+        {
+            std::string version;                               // 测试框架源码+编译选项的哈希
+            std::shared_future<std::shared_ptr<const std::string>> obj; // 目标文件路径，编译失败时为nullptr
+        };
+
+    public:
+        /**
+         * @brief 全局唯一的测试框架缓存
+         *
+         */
+        static HarnessCache &GetInstance()
+        {
+            static HarnessCache instance;
+            return instance;
+        }
+        HarnessCache(const HarnessCache &) = delete;
+        HarnessCache &operator=(const HarnessCache &) = delete;
+
+        /**
+         * @brief 获取题目测试框架的目标文件，不存在时编译
+         * number：题目编号
+         * src：测试框架源码
+         * obj：输出型参数，目标文件路径，链接完成之前需要一直持有
+         * return：真为成功
+         *
+         * 同一版本并发请求时只编译一次，其余请求等待编译结果
+         * 题目的测试框架更新后，旧版本的目标文件在最后一个持有者释放时删除，正在链接的任务不受影响
+         */
+        bool Get(const std::string &number, const std::string &src, std::shared_ptr<const std::string> *obj)
+        {
+            std::string flags;
+            for (const auto &flag : Compiler::CompileFlags())
+            {
+                flags += flag;
+                flags += '\0';
+            }
+            std::string version = StringUtil::HashToHex(flags + '\0' + src);
+
+            std::shared_ptr<std::promise<std::shared_ptr<const std::string>>> builder;
+            std::shared_future<std::shared_ptr<const std::string>> result;
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                auto iter = _entries.find(number);
+                if (iter != _entries.end() && iter->second.version == version)
+                {
+                    result = iter->second.obj;
+                }
+                else
+                {
+                    builder = std::make_shared<std::promise<std::shared_ptr<const std::string>>>();
+                    result = builder->get_future().share();
+                    _entries[number] = Entry{version, result};
+                }
+            }
+
+            if (builder)
+            {
+                builder->set_value(Build(number, version, src));
+            }
+
+            *obj = result.get();
+            if (!*obj)
+            {
+                // 编译失败不缓存，下次请求重新编译
+                std::lock_guard<std::mutex> lock(_mtx);
+                auto iter = _entries.find(number);
+                if (iter != _entries.end() && iter->second.version == version)
+                {
+                    _entries.erase(iter);
+                }
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        HarnessCache()
+        {
+            mkdir(harnessDirPath.c_str(), 0755);
+        }
+
+        /**
+         * @brief 编译测试框架
+         * return：目标文件路径，最后一个持有者释放时删除目标文件；失败时为nullptr
+         */
+        std::shared_ptr<const std::string> Build(const std::string &number, const std::string &version, const std::string &src)
+        {
+            // 每次编译使用独立的路径，版本来回切换时，旧目标文件的删除不会影响新编译的
+            std::string base = harnessDirPath + version + "." + std::to_string(++_builds);
+            std::string obj = base + ".o";
+            if (!FileUtil::WriteFile(base + ".cpp", src))
+            {
+                LOG(ERROR) << "写入测试框架源码失败，题目：" << number << std::endl;
+                return nullptr;
+            }
+            bool ok = Compiler::CompileObject(base + ".cpp", obj, base + ".compiler_error");
+            unlink((base + ".cpp").c_str());
+            unlink((base + ".compiler_error").c_str());
+            if (!ok)
+            {
+                LOG(ERROR) << "编译测试框架失败，题目：" << number << std::endl;
+                return nullptr;
+            }
+            LOG(INFO) << "编译测试框架成功，题目：" << number << "，版本：" << version << std::endl;
+            return std::shared_ptr<const std::string>(new std::string(obj), [](const std::string *path)
+                                                      {
+                                                          unlink(path->c_str());
+                                                          delete path;
+                                                      });
+        }
+
+    private:
+        std::unordered_map<std::string, Entry> _entries; // 题号->测试框架
+        std::mutex _mtx;
+        std::atomic<unsigned long> _builds{0}; // 已编译的次数，用于区分目标文件路径
+    };
+}
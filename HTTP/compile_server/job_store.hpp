@@ -0,0 +1,230 @@
+/*
+* 异步任务结果存储
+* POST /jobs 提交后立即返回任务id，结果由流水线写入，GET /jobs/{id} 查询或长轮询
+* 条目数有上限，已完成的结果保留 jobResultTtlSec 秒后淘汰
+* DELETE /jobs/{id} 取消任务：删除条目并置位取消标记，流水线跳过尚未开始的阶段
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <list>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+namespace ns_job_store
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    const size_t jobStoreMaxEntries = 4096; // 最多保存的任务数(未完成+已完成)
+    const int jobResultTtlSec = 60;         // 已完成的结果保留时间 (s)
+    const int jobMaxWaitMs = 30 * 1000;     // 长轮询的最长等待时间 (ms)
+
+    enum class JobState
+    {
+        NotFound, // 不存在或已过期
+        Pending,  // 排队中或执行中
+        Done,     // 已完成
+    };
+
+    class JobStore
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Entry
+        {
+            bool done = false;
+            std::string outJson;
+            Clock::time_point expire;             // 完成后才有效
+            std::list<std::string>::iterator pos; // 在完成链表中的位置
+            std::shared_ptr<std::atomic<bool>> cancelled;
+        };
+
+        JobStore() {}
+
+    public:
+        static JobStore &GetInstance()
+        {
+            static JobStore instance;
+            return instance;
+        }
+        JobStore(const JobStore &) = delete;
+        JobStore &operator=(const JobStore &) = delete;
+
+        /**
+         * @brief 登记一个新任务
+         * id：输出参数，任务id
+         * cancelled：输出参数，任务的取消标记，提交流水线时传入
+         * return：存储已满(全部为未完成任务)时为假
+         */
+        bool Create(std::string *id, std::shared_ptr<std::atomic<bool>> *cancelled)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            Expire();
+            // 已满时先淘汰最早完成的结果
+            while (_entries.size() >= jobStoreMaxEntries && !_doneOrder.empty())
+            {
+                _entries.erase(_doneOrder.front());
+                _doneOrder.pop_front();
+            }
+            if (_entries.size() >= jobStoreMaxEntries)
+            {
+                return false;
+            }
+            *id = FileUtil::UniqFileName();
+            Entry &entry = _entries[*id];
+            entry.cancelled = std::make_shared<std::atomic<bool>>(false);
+            *cancelled = entry.cancelled;
+            return true;
+        }
+
+        /**
+         * @brief 写入任务结果，唤醒等待该任务的长轮询
+         *
+         */
+        void Complete(const std::string &id, const std::string &outJson)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                auto iter = _entries.find(id);
+                if (iter == _entries.end())
+                {
+                    return;
+                }
+                Entry &entry = iter->second;
+                entry.done = true;
+                entry.outJson = outJson;
+                entry.expire = Clock::now() + std::chrono::seconds(jobResultTtlSec);
+                entry.pos = _doneOrder.insert(_doneOrder.end(), id);
+            }
+            _cond.notify_all();
+        }
+
+        /**
+         * @brief 删除未能进入流水线的任务
+         *
+         */
+        void Remove(const std::string &id)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            auto iter = _entries.find(id);
+            if (iter == _entries.end())
+            {
+                return;
+            }
+            if (iter->second.done)
+            {
+                _doneOrder.erase(iter->second.pos);
+            }
+            _entries.erase(iter);
+        }
+
+        /**
+         * @brief 取消任务，之后查询该任务得到NotFound，结果不再保存
+         * return：任务不存在或已过期时为假
+         */
+        bool Cancel(const std::string &id)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                auto iter = _entries.find(id);
+                if (iter == _entries.end())
+                {
+                    return false;
+                }
+                if (iter->second.done)
+                {
+                    _doneOrder.erase(iter->second.pos);
+                }
+                else
+                {
+                    iter->second.cancelled->store(true);
+                }
+                _entries.erase(iter);
+            }
+            // 唤醒该任务的长轮询
+            _cond.notify_all();
+            return true;
+        }
+
+        /**
+         * @brief 查询任务结果
+         * waitMs：任务未完成时最多等待的时间 (ms)，0为不等待，超过 jobMaxWaitMs 时按 jobMaxWaitMs 计
+         * outJson：任务完成时为结果
+         */
+        JobState Get(const std::string &id, int waitMs, std::string *outJson)
+        {
+            if (waitMs > jobMaxWaitMs)
+            {
+                waitMs = jobMaxWaitMs;
+            }
+            Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(waitMs > 0 ? waitMs : 0);
+
+            std::unique_lock<std::mutex> lock(_mtx);
+            Expire();
+            while (true)
+            {
+                auto iter = _entries.find(id);
+                if (iter == _entries.end())
+                {
+                    return JobState::NotFound;
+                }
+                if (iter->second.done)
+                {
+                    *outJson = iter->second.outJson;
+                    return JobState::Done;
+                }
+                if (std::cv_status::timeout == _cond.wait_until(lock, deadline))
+                {
+                    // 超时前最后检查一次
+                    iter = _entries.find(id);
+                    if (iter != _entries.end() && iter->second.done)
+                    {
+                        *outJson = iter->second.outJson;
+                        return JobState::Done;
+                    }
+                    return iter == _entries.end() ? JobState::NotFound : JobState::Pending;
+                }
+            }
+        }
+
+    private:
+        /**
+         * @brief 淘汰过期的结果，调用者持有锁
+         * 完成链表按完成时间排序，过期时间同序
+         */
+        void Expire()
+        {
+            Clock::time_point now = Clock::now();
+            while (!_doneOrder.empty())
+            {
+                auto iter = _entries.find(_doneOrder.front());
+                if (iter != _entries.end() && iter->second.expire > now)
+                {
+                    break;
+                }
+                if (iter != _entries.end())
+                {
+                    _entries.erase(iter);
+                }
+                _doneOrder.pop_front();
+            }
+        }
+
+    private:
+        std::unordered_map<std::string, Entry> _entries;
+        std::list<std::string> _doneOrder; // 已完成任务的id，按完成时间排序
+        std::mutex _mtx;
+        std::condition_variable _cond;
+    };
+}
@@ -0,0 +1,271 @@
+/*
+* 编译运行流水线
+* 编译阶段与运行阶段各有一个线程池与有界队列，编译完成的请求进入运行队列
+* 编译线程数受CPU核数与可用内存共同约束(g++占用内存较多)
+* 运行线程只负责启动程序，程序交给Supervisor监控，结束后的处理再交回运行线程池，线程不随程序等待
+* 同时运行的程序数由maxRuns限制(默认CPU核数)，与运行线程数、运行队列长度各自独立
+* 编译队列已满时拒绝新请求；运行队列已满时编译线程等待，编译阶段随之变慢(背压)
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+#include "../comm/worker_pool.hpp"
+#include "./compile_run.hpp"
+
+namespace ns_pipeline
+{
+    using namespace ns_log;
+    using namespace ns_util;
+    using namespace ns_worker_pool;
+    using namespace ns_compile_and_run;
+
+    const long compileMemPerWorkerKB = 512 * 1024; // 每个编译线程预留的内存 (KB)，即一个g++进程的峰值
+    const int batchRetryMs = 10;                   // 批量请求遇到编译队列已满时的重试间隔 (ms)
+    const size_t defaultRunWorkersMax = 4;         // 默认运行线程数的上限，启动程序与比对输出用不了更多线程
+
+    // 各项为0时按机器配置自动计算
+    struct PipelineOptions
+    {
+        size_t compileWorkers = 0; // 默认 min(CPU核数, 可用内存/compileMemPerWorkerKB)
+        size_t runWorkers = 0;     // 默认 min(CPU核数, defaultRunWorkersMax)
+        size_t maxRuns = 0;        // 同时运行的程序数，默认 CPU核数
+        size_t compileQueue = 0;   // 默认 编译线程数*4
+        size_t runQueue = 0;       // 默认 同时运行的程序数*2
+    };
+
+    class Pipeline
+    {
+    private:
+        Pipeline() : _maxRuns(0), _runJobs(0) {}
+        Pipeline(const Pipeline &) = delete;
+        Pipeline &operator=(const Pipeline &) = delete;
+
+    public:
+        static Pipeline &GetInstance()
+        {
+            static Pipeline pipeline;
+            return pipeline;
+        }
+
+        /**
+         * @brief 创建两个阶段的线程池，服务启动时、处理请求之前调用一次
+         *
+         */
+        void Init(const PipelineOptions &opt)
+        {
+            size_t cores = SysUtil::CpuCores();
+            size_t compileWorkers = opt.compileWorkers;
+            if (0 == compileWorkers)
+            {
+                size_t byMem = SysUtil::MemAvailableKB() / compileMemPerWorkerKB;
+                compileWorkers = std::max<size_t>(1, std::min(cores, byMem));
+            }
+            size_t runWorkers = opt.runWorkers ? opt.runWorkers : std::min(cores, defaultRunWorkersMax);
+            _maxRuns = opt.maxRuns ? opt.maxRuns : cores;
+            size_t compileQueue = opt.compileQueue ? opt.compileQueue : compileWorkers * 4;
+            size_t runQueue = opt.runQueue ? opt.runQueue : _maxRuns * 2;
+
+            RunSlots::GetInstance().SetMax(_maxRuns);
+            _compilePool.reset(new WorkerPool("compile", compileWorkers, compileQueue));
+            _runPool.reset(new WorkerPool("run", runWorkers, runQueue));
+            LOG(INFO) << "流水线启动成功，编译线程：" << compileWorkers << "，编译队列：" << compileQueue
+                      << "，运行线程：" << runWorkers << "，同时运行：" << _maxRuns << "，运行队列：" << runQueue << std::endl;
+        }
+
+        /**
+         * @brief 提交一次编译运行请求
+         * inJson：请求，结构见 CompileAndRun::Parse
+         * done：结果生成后在流水线线程中调用，参数为outJson
+         * cancelled：取消标记(选填)，置位后尚未开始的编译/运行阶段不再执行，结果状态码为-6
+         * return：编译队列已满时为假，done不会被调用
+         */
+        bool Submit(const std::string &inJson, const std::function<void(const std::string &)> &done,
+                    const std::shared_ptr<std::atomic<bool>> &cancelled = nullptr)
+        {
+            Json::Value inValue;
+            Json::Reader reader;
+            reader.parse(inJson, inValue);
+            return SubmitValue(
+                inValue, [done](const Json::Value &outValue)
+                {
+                    Json::StyledWriter writer;
+                    done(writer.write(outValue));
+                },
+                cancelled);
+        }
+
+        /**
+         * @brief 提交一次已反序列化的编译运行请求，done的参数为结构化的结果
+         *
+         */
+        bool SubmitValue(const Json::Value &inValue, const std::function<void(const Json::Value &)> &done,
+                         const std::shared_ptr<std::atomic<bool>> &cancelled = nullptr)
+        {
+            std::shared_ptr<Job> job = std::make_shared<Job>();
+            job->cancelled = cancelled;
+            if (!CompileAndRun::Parse(inValue, job.get()))
+            {
+                // 无需编译，直接返回结果
+                Json::Value outValue;
+                CompileAndRun::Finish(job.get(), &outValue);
+                done(outValue);
+                return true;
+            }
+
+            return _compilePool->TryPush([this, job, done]
+                                         {
+                                             bool cancelled = job->Cancelled();
+                                             if (cancelled)
+                                             {
+                                                 job->statusCode = -6;
+                                             }
+                                             if (cancelled || !CompileAndRun::CompileStage(job.get()))
+                                             {
+                                                 Json::Value outValue;
+                                                 CompileAndRun::Finish(job.get(), &outValue);
+                                                 done(outValue);
+                                                 return;
+                                             }
+                                             _runPool->Push([this, job, done]
+                                                            { Run(job, done); });
+                                         });
+        }
+
+        /**
+         * @brief 运行阶段，在运行线程中启动程序后返回，程序结束后的处理经Post交回运行线程池
+         *
+         */
+        void Run(const std::shared_ptr<Job> &job, const std::function<void(const Json::Value &)> &done)
+        {
+            if (job->Cancelled())
+            {
+                job->statusCode = -6;
+                Json::Value outValue;
+                CompileAndRun::Finish(job.get(), &outValue);
+                done(outValue);
+                return;
+            }
+            ++_runJobs;
+            WorkerPool *runPool = _runPool.get();
+            CompileAndRun::RunStage(
+                job.get(), [runPool](const std::function<void()> &task)
+                { runPool->Post(task); },
+                [this, job, done]
+                {
+                    --_runJobs;
+                    Json::Value outValue;
+                    CompileAndRun::Finish(job.get(), &outValue);
+                    done(outValue);
+                });
+        }
+
+        /**
+         * @brief 批量编译运行，阻塞直到全部完成
+         * inArray：请求数组，每一项的结构见 CompileAndRun::Parse
+         * outArray：结果数组，与请求一一对应
+         *
+         * 同一批次同时在流水线中的请求数不超过编译线程数与同时运行的程序数之和，避免占满队列使其他请求得到503
+         * 编译队列被其他请求占满时，等待本批次完成一项或 batchRetryMs 后重试
+         */
+        void SubmitBatch(const Json::Value &inArray, Json::Value *outArray)
+        {
+            size_t total = inArray.size();
+            size_t window = _compilePool->Threads() + _maxRuns;
+            std::vector<Json::Value> results(total);
+            size_t inFlight = 0;
+            size_t finished = 0;
+            std::mutex mtx;
+            std::condition_variable cond;
+
+            for (Json::ArrayIndex i = 0; i < total; i++)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cond.wait(lock, [&]
+                              { return inFlight < window; });
+                    ++inFlight;
+                }
+                // 结果在持有锁时写入并通知，本函数返回前所有回调都已结束
+                auto done = [&, i](const Json::Value &outValue)
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    results[i] = outValue;
+                    --inFlight;
+                    ++finished;
+                    cond.notify_all();
+                };
+                while (!SubmitValue(inArray[i], done))
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cond.wait_for(lock, std::chrono::milliseconds(batchRetryMs));
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cond.wait(lock, [&]
+                      { return finished == total; });
+            *outArray = Json::Value(Json::arrayValue);
+            for (auto &result : results)
+            {
+                outArray->append(result);
+            }
+        }
+
+        /**
+         * @brief 流水线最多同时容纳的请求数，即两个阶段的线程数、队列长度与同时运行的程序数之和
+         *
+         */
+        size_t Capacity() const
+        {
+            return _compilePool->Threads() + _compilePool->MaxQueue() + _runPool->Threads() + _runPool->MaxQueue() + _maxRuns;
+        }
+
+        /**
+         * @brief 执行中/排队中的请求数，用于负载上报
+         *
+         */
+        size_t Running()
+        {
+            return _compilePool->Busy() + _runJobs;
+        }
+        // 处于运行阶段(程序运行中或在两组用例之间)的请求数
+        size_t RunJobs() const
+        {
+            return _runJobs;
+        }
+        size_t MaxRuns() const
+        {
+            return _maxRuns;
+        }
+        size_t Queued()
+        {
+            return _compilePool->Queued() + _runPool->Queued();
+        }
+
+        WorkerPool &CompilePool()
+        {
+            return *_compilePool;
+        }
+        WorkerPool &RunPool()
+        {
+            return *_runPool;
+        }
+
+    private:
+        std::unique_ptr<WorkerPool> _compilePool;
+        std::unique_ptr<WorkerPool> _runPool;
+        size_t _maxRuns;
+        std::atomic<size_t> _runJobs;
+    };
+}
@@ -0,0 +1,118 @@
+/*
+* 拉取模式
+* 每个拉取线程对应流水线的一个空闲位置：长轮询oj_server的 /judge_tasks 领取任务，交给流水线，完成后提交结果，再领取下一个
+* 同时领取的任务数不超过流水线两个阶段的线程数之和，处理得快的节点自然领取得多
+* 领取与提交结果都携带共享密钥，结果凭领取时发放的租约号提交
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <future>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <jsoncpp/json/json.h>
+
+#include "../comm/httplib.h"
+#include "../comm/log.hpp"
+#include "./pipeline.hpp"
+
+namespace ns_puller
+{
+    using namespace ns_log;
+    using namespace ns_pipeline;
+
+    const int pullWaitMs = 20 * 1000;       // 单次长轮询的等待时间 (ms)
+    const int pullErrorBackoffMs = 1000;    // oj_server不可用时重试的间隔 (ms)
+    const int pullResultRetries = 3;        // 提交结果失败时的重试次数
+    const char *pullTokenHeader = "X-Judge-Token"; // 携带共享密钥的请求头，与oj_server一致
+
+    class Puller
+    {
+    public:
+        /**
+         * @brief 启动拉取线程，流水线初始化之后调用
+         * host/port：oj_server的地址
+         * slots：拉取线程数，0为编译线程数与同时运行的程序数之和
+         * token：oj_server(--pull-token)的共享密钥，为空时不携带
+         */
+        static void Start(const std::string &host, int port, size_t slots, const std::string &token)
+        {
+            Pipeline &pipeline = Pipeline::GetInstance();
+            if (0 == slots)
+            {
+                slots = pipeline.CompilePool().Threads() + pipeline.MaxRuns();
+            }
+            for (size_t i = 0; i < slots; i++)
+            {
+                std::thread(&Puller::Loop, host, port, token).detach();
+            }
+            LOG(INFO) << "拉取模式已开启，oj_server：" << host << ":" << port << "，拉取线程：" << slots << std::endl;
+        }
+
+    private:
+        static void Loop(const std::string host, int port, const std::string token)
+        {
+            httplib::Client cli(host, port);
+            cli.set_read_timeout(pullWaitMs / 1000 + 5, 0);
+            cli.set_keep_alive(true);
+            if (!token.empty())
+            {
+                cli.set_default_headers({{pullTokenHeader, token}});
+            }
+            std::string fetchPath = "/judge_tasks?wait=" + std::to_string(pullWaitMs);
+            while (true)
+            {
+                auto res = cli.Get(fetchPath.c_str());
+                if (!res || (res->status != 200 && res->status != 204))
+                {
+                    if (res && res->status == 401)
+                    {
+                        LOG(ERROR) << "oj_server拒绝领取任务，请检查--pull-token" << std::endl;
+                    }
+                    usleep(pullErrorBackoffMs * 1000);
+                    continue;
+                }
+                if (res->status == 204) // 暂无任务
+                {
+                    continue;
+                }
+                Json::Value taskVal;
+                Json::Reader reader;
+                if (!reader.parse(res->body, taskVal))
+                {
+                    continue;
+                }
+                std::string outJson = Run(taskVal["request"].asString());
+                std::string resultPath = "/judge_tasks/" + taskVal["lease"].asString() + "/result";
+                for (int i = 0; i < pullResultRetries; i++)
+                {
+                    auto post = cli.Post(resultPath.c_str(), outJson, "application/json");
+                    if (post) // 404：任务已被oj_server放弃
+                    {
+                        break;
+                    }
+                    usleep(pullErrorBackoffMs * 1000);
+                }
+            }
+        }
+
+        /**
+         * @brief 交给流水线并等待结果，编译队列被推送的请求占满时稍后重试
+         *
+         */
+        static std::string Run(const std::string &inJson)
+        {
+            auto result = std::make_shared<std::promise<std::string>>();
+            std::future<std::string> outJson = result->get_future();
+            while (!Pipeline::GetInstance().Submit(inJson, [result](const std::string &out)
+                                                   { result->set_value(out); }))
+            {
+                usleep(batchRetryMs * 1000);
+            }
+            return outJson.get();
+        }
+    };
+}
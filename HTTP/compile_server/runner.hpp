@@ -9,15 +9,95 @@
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <csignal>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #include "../comm/util.hpp"
 #include "../comm/log.hpp"
+#include "./spawner.hpp"
+#include "./zygote.hpp"
+#include "./supervisor.hpp"
+#include "./cgroup.hpp"
 
 namespace ns_runner
 {
 
     using namespace ns_log;
     using namespace ns_util;
+    using namespace ns_spawner;
+    using namespace ns_zygote;
+    using namespace ns_supervisor;
+    using namespace ns_cgroup;
+
+    // 一次运行的结果，程序结束后交给回调
+    struct RunOutcome
+    {
+        int code = 0;    // 含义见Runner::Run
+        std::string out; // 标准输出，超出上限时只保留前面的部分
+        std::string err; // 标准错误
+        RunUsage usage;  // 资源使用
+    };
+    typedef std::function<void(RunOutcome &)> RunCallback;
+
+    /**
+     * @brief 同时运行的程序数上限
+     * 程序启动后不再占用线程，同时运行的程序数改由此处限制，超出时启动程序的线程等待
+     */
+    class RunSlots
+    {
+    private:
+        RunSlots() : _max(0), _active(0) {}
+        RunSlots(const RunSlots &) = delete;
+        RunSlots &operator=(const RunSlots &) = delete;
+
+    public:
+        static RunSlots &GetInstance()
+        {
+            static RunSlots slots;
+            return slots;
+        }
+
+        // 服务启动时、处理请求之前调用，0为不限制
+        void SetMax(size_t max)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _max = max;
+        }
+        size_t Max()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            return _max;
+        }
+        void Acquire()
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _cond.wait(lock, [this]
+                       { return 0 == _max || _active < _max; });
+            ++_active;
+        }
+        void Release()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                --_active;
+            }
+            _cond.notify_one();
+        }
+        // 运行中的程序数
+        size_t Active()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            return _active;
+        }
+
+    private:
+        size_t _max;
+        size_t _active;
+        std::mutex _mtx;
+        std::condition_variable _cond;
+    };
 
     class Runner
     {
@@ -26,119 +106,300 @@ namespace ns_runner
         ~Runner() {}
 
         /*
-        * cpu(s), 内存(M)
+        * 资源约束，cpu(ms), 内存(KB)，与cgroup的memory.max单位一致
+        * 在子进程exec之前由Spawner设置
+        * CPU时间由Supervisor按毫秒检查，RLIMIT_CPU只能精确到秒，多留1秒作为兜底
         */
-        static void SetRlimit(rlim_t cpuLimit, rlim_t memLimit)
+        static void SetRlimit(SpawnOptions *opt, int cpuLimitMs, rlim_t memLimit)
         {
             // CPU
-            struct rlimit cpuR = {cpuLimit, RLIM_INFINITY};
-            setrlimit(RLIMIT_CPU, &cpuR);
+            opt->cpuLimit = cpuLimitMs > 0 ? (cpuLimitMs + 999) / 1000 + 1 : 0;
             // 内存
-            struct rlimit memR = {memLimit * 1024 * 1024, RLIM_INFINITY};
-            setrlimit(RLIMIT_AS, &memR);
+            opt->memLimit = memLimit * 1024;
         }
 
         /*
         * 输入参数：
         *  codeFile：需要编译的文件的文件名
-        *  cpuLimit：CPU资源上限 (s)
+        *  cpuLimitMs：CPU时间上限 (ms)，0为不限制
+        *  wallLimitMs：墙钟时间上限 (ms)，0为不限制
         *  memLimit：内存资源上限 (KB)
-        * 返回值：
+        *  outputLimitKB：标准输出与标准错误合计的上限 (KB)，0为不限制
+        *  inFd：标准输入，-1为空，由调用者关闭
+        *  done：程序结束后在Supervisor的监控线程中调用，未能启动时在本线程中直接调用，应尽快返回
+        * 本函数启动程序后立即返回，不等待程序结束
+        * 结果/RunOutcome：
+        *  out/err：程序的标准输出/标准错误，超出上限时只保留前面的部分
+        *  usage：程序运行后的资源使用
+        *  code：
         *  = 0 运行成功，结果正确/错误
-        *  > 0 运行失败，返回值代表错误信号(触发信号)
+        *  > 0 运行失败，值为错误信号(触发信号)，超出CPU/墙钟时间限制时为SIGXCPU，超出输出限制时为SIGXFSZ
         *  < 0 内部错误，程序没运行
-        *       -1 无法打开标准文件
-        *       -2 子进程创建失败，即程序根本没运行
+        *       -1 无法创建管道
+        *       -2 子进程创建或程序替换失败，即程序根本没运行
         *       -3 子进程替换失败，即程序根本没运行
         * 
         * Run只关心代码是否运行成功，不关心结果的对错
         * 结果对错，由其他代码判定
         * 
-        * 标准输入：不处理（用户自测样例）<- codeFile.stdin
-        * 标准输出：运行结果 -> codeFile.stdout
-        * 标准错误：运行时错误信息 -> codeFile.stderr
+        * 标准输入：inFd，如测试数据的memfd；-1时为空（用户自测样例不处理）
+        * 标准输出：运行结果 -> out
+        * 标准错误：运行时错误信息 -> err
+        * 输出经管道直接读入内存，不再写入./temp/下的文件再读回
         * 注意：程序不正常退出时的状态码不在标准错误中，而是在父进程的返回值中
         */
-        static int Run(const std::string &codeFile, int cpuLimit, int memLimit)
+        static void Run(const std::string &codeFile, int cpuLimitMs, int wallLimitMs, int memLimit, int outputLimitKB, int inFd,
+                        const RunCallback &done)
         {
+            SpawnOptions opt;
+            opt.args = {PathUtil::BuildExe(codeFile)};
+            RunWithPipes(opt, cpuLimitMs, wallLimitMs, memLimit, outputLimitKB, inFd, done);
+        }
 
-            // 构建路径
-            std::string exePath = PathUtil::BuildExe(codeFile);
-            std::string _stdin = PathUtil::BuildStdin(codeFile);
-            std::string _stdout = PathUtil::BuildStdout(codeFile);
-            std::string _stderr = PathUtil::BuildStderr(codeFile);
-            // 打开文件，父进程关闭，子进程使用
-            umask(0);
-            int _stdinFd = open(_stdin.c_str(), O_CREAT | O_RDONLY, 0644);
-            int _stdoutFd = open(_stdout.c_str(), O_CREAT | O_WRONLY, 0644);
-            int _stderrFd = open(_stderr.c_str(), O_CREAT | O_WRONLY, 0644);
-            // 差错处理
-            if (_stdinFd < 0 || _stdoutFd < 0 || _stderrFd < 0)
-            {
-                LOG(ERROR) << "无法为程序打开标准文件\n";
-                return -1;
-            }
-            // 创建子进程，进行进程替换
-            pid_t childPid = fork();
-            if (childPid < 0) // 失败
-            {
-                close(_stdinFd);
-                close(_stdoutFd);
-                close(_stderrFd);
-                LOG(ERROR) << "运行时创建子进程失败\n";
-                return -2;
+        /*
+        * 不落盘运行：通过fexecve执行memfd中的程序
+        * 输入参数：
+        *  exeFd：可执行程序的fd，由调用者关闭
+        *  其余参数与结果同Run
+        */
+        static void RunInMemory(int exeFd, int cpuLimitMs, int wallLimitMs, int memLimit, int outputLimitKB, int inFd,
+                                const RunCallback &done)
+        {
+            SpawnOptions opt;
+            opt.args = {"main"};
+            opt.exeFd = exeFd;
+            RunWithPipes(opt, cpuLimitMs, wallLimitMs, memLimit, outputLimitKB, inFd, done);
+        }
+
+    private:
+        /*
+        * 占用一个运行名额，为程序创建标准输出/标准错误管道并启动，结果与Run相同
+        * inFd为-1时标准输入为空管道，否则使用其副本
+        * 名额在调用done之前归还
+        */
+        static void RunWithPipes(SpawnOptions &opt, int cpuLimitMs, int wallLimitMs, int memLimit, int outputLimitKB, int inFd,
+                                 const RunCallback &done)
+        {
+            RunSlots::GetInstance().Acquire();
+            RunCallback finish = [done](RunOutcome &outcome)
+            {
+                RunSlots::GetInstance().Release();
+                done(outcome);
+            };
+
+            int inPipe[2], outPipe[2], errPipe[2];
+            if (inFd >= 0)
+            {
+                inPipe[0] = fcntl(inFd, F_DUPFD_CLOEXEC, 0);
+                inPipe[1] = -1;
+            }
+            else if (0 != pipe2(inPipe, O_CLOEXEC))
+            {
+                inPipe[0] = -1;
             }
-            else if (0 == childPid) // 子进程
+            if (inPipe[0] < 0)
             {
-                // 重定向
-                dup2(_stdinFd, 0);
-                dup2(_stdoutFd, 1);
-                dup2(_stderrFd, 2);
-                // 资源约束 时间 1s，空间 1G
-                SetRlimit(cpuLimit, memLimit);
-                // LOG(INFO) << "SetRlimit\n";
-                // path, exe
-                execl(exePath.c_str(), exePath.c_str(), nullptr);
-                exit(1); // 走到这里代表替换失败
+                LOG(ERROR) << "无法为程序创建管道\n";
+                Fail(-1, finish);
+                return;
             }
-            else // 父进程
+            if (0 != pipe2(outPipe, O_CLOEXEC))
             {
-                close(_stdinFd);
-                close(_stdoutFd);
-                close(_stderrFd);
+                close(inPipe[0]);
+                if (inPipe[1] >= 0)
+                    close(inPipe[1]);
+                LOG(ERROR) << "无法为程序创建管道\n";
+                Fail(-1, finish);
+                return;
+            }
+            if (0 != pipe2(errPipe, O_CLOEXEC))
+            {
+                close(inPipe[0]);
+                if (inPipe[1] >= 0)
+                    close(inPipe[1]);
+                close(outPipe[0]);
+                close(outPipe[1]);
+                LOG(ERROR) << "无法为程序创建管道\n";
+                Fail(-1, finish);
+                return;
+            }
 
+            opt.redirects = {{inPipe[0], 0}, {outPipe[1], 1}, {errPipe[1], 2}};
+            SetRlimit(&opt, cpuLimitMs, memLimit);
+            if (inPipe[1] >= 0)
+                close(inPipe[1]); // 标准输入为空
+            Execute(opt, cpuLimitMs, wallLimitMs, memLimit, (size_t)outputLimitKB * 1024, outPipe[0], errPipe[0], finish);
+        }
+
+        /*
+        * 启动程序，结果与Run相同
+        * 优先交给zygote进程池中预先创建好的子进程，zygote不可用时由本进程创建子进程
+        * 程序启动后交给Supervisor监控退出与时间限制，本线程随即返回，程序结束后由监控线程调用done
+        * 开启cgroup时程序在一个运行槽位中执行，内存由memory.max按memLimit(KB)限制，不再设置RLIMIT_AS，
+        * CPU时间与内存峰值改为从cgroup读取(含程序创建的子进程)；槽位不可用时按原方式运行
+        * opt.redirects中的fd由本函数关闭，outFd/errFd为管道读端(可为-1)，读到的内容交给done，合计不超过outputLimit字节
+        */
+        static void Execute(SpawnOptions opt, int cpuLimitMs, int wallLimitMs, int memLimit, size_t outputLimit,
+                            int outFd, int errFd, const RunCallback &done)
+        {
+            CgroupPool &cgroups = CgroupPool::GetInstance();
+            CgroupSlot *slot = cgroups.Enabled() ? cgroups.Acquire() : nullptr;
+            if (slot && !slot->Prepare(memLimit))
+            {
+                cgroups.Release(slot);
+                slot = nullptr;
+            }
+            if (slot)
+            {
+                opt.memLimit = 0;
+                opt.cgroupFd = slot->ProcsFd();
+            }
+
+            int replyFd = Zygote::Enabled() ? Zygote::Submit(opt) : -1;
+            pid_t childPid = -1;
+            if (replyFd < 0)
+            {
+                childPid = Spawner::Spawn(opt);
+            }
+            for (const auto &r : opt.redirects)
+            {
+                close(r.first);
+            }
+            if (replyFd < 0 && childPid < 0) // 失败
+            {
+                if (slot)
+                    cgroups.Release(slot);
+                if (outFd >= 0)
+                    close(outFd);
+                if (errFd >= 0)
+                    close(errFd);
+                LOG(ERROR) << "运行时创建子进程失败\n";
+                Fail(-2, done);
+                return;
+            }
+
+            WatchOptions watch;
+            watch.outFd = outFd;
+            watch.errFd = errFd;
+            watch.cpuLimitMs = cpuLimitMs;
+            watch.wallLimitMs = wallLimitMs;
+            watch.outputLimit = outputLimit;
+            if (replyFd >= 0)
+            {
                 int status = 0;
-                waitpid(childPid, &status, 0); // 阻塞等待
-                // 子进程正常结束
-                if (WIFEXITED(status))
+                if (!Zygote::Started(replyFd, &watch.pid, &watch.pidFd, &status))
+                {
+                    if (slot)
+                        cgroups.Release(slot);
+                    close(replyFd);
+                    if (outFd >= 0)
+                        close(outFd);
+                    if (errFd >= 0)
+                        close(errFd);
+                    Fail(ParseStatus(status), done);
+                    return;
+                }
+                watch.exitFd = replyFd;
+                watch.reap = [replyFd](int *st, struct rusage *ru)
+                { return Zygote::Wait(replyFd, false, st, ru); };
+            }
+            else
+            {
+                watch.pid = childPid;
+                watch.pidFd = SysUtil::PidfdOpen(childPid);
+                watch.exitFd = watch.pidFd;
+                watch.reap = [childPid](int *st, struct rusage *ru)
+                { return wait4(childPid, st, WNOHANG, ru) == childPid; };
+            }
+
+            Supervisor::GetInstance().Watch(watch, [slot, done](WatchResult &result)
+                                            {
+                                                bool oomKilled = false;
+                                                if (slot)
+                                                {
+                                                    long peakKB = -1;
+                                                    slot->Collect(&result.usage.cpuMs, &peakKB, &oomKilled);
+                                                    CgroupPool::GetInstance().Release(slot);
+                                                    if (peakKB >= 0)
+                                                        result.usage.peakRssKB = peakKB;
+                                                }
+                                                RunOutcome outcome;
+                                                outcome.code = ParseResult(result, oomKilled);
+                                                outcome.out = std::move(result.out);
+                                                outcome.err = std::move(result.err);
+                                                outcome.usage = result.usage;
+                                                done(outcome);
+                                            });
+        }
+
+        /*
+        * 程序未能启动，直接以code结束
+        */
+        static void Fail(int code, const RunCallback &done)
+        {
+            RunOutcome outcome;
+            outcome.code = code;
+            done(outcome);
+        }
+
+        /*
+        * 将监控结果转换为Run的结果码
+        */
+        static int ParseResult(const WatchResult &result, bool oomKilled)
+        {
+            if (result.truncated)
+            {
+                // 与超出RLIMIT_FSIZE一致，当成触发 SIGXFSZ
+                return SIGXFSZ;
+            }
+            if (result.killed != KillReason::None)
+            {
+                // 与超出RLIMIT_CPU一致，当成触发 SIGXCPU
+                return SIGXCPU;
+            }
+            if (oomKilled)
+            {
+                // 与RLIMIT_AS下申请内存失败(std::bad_alloc -> abort)一致，当成触发 SIGABRT
+                LOG(INFO) << "程序超出内存限制，已被cgroup终止" << std::endl;
+                return SIGABRT;
+            }
+            return ParseStatus(result.status);
+        }
+
+        /*
+        * 将子进程的退出状态转换为Run的结果码
+        */
+        static int ParseStatus(int status)
+        {
+            // 子进程正常结束
+            if (WIFEXITED(status))
+            {
+                LOG(INFO) << "代码运行完毕，info：" << WEXITSTATUS(status) << std::endl;
+
+                // 正常结束
+                if(WEXITSTATUS(status) == 0)
                 {
-                    LOG(INFO) << "代码运行完毕，info：" << WEXITSTATUS(status) << std::endl;
-
-                    // 正常结束
-                    if(WEXITSTATUS(status) == 0)
-                    {
-                        return 0;
-                    }
-                    // 触发SIGALRM，当成触发 SIGXCPU
-                    else if(WEXITSTATUS(status) == SIGALRM)
-                    {
-                        return SIGXCPU;
-                    }
-                    // 子进程程序替换失败，即用户程序未能运行起来，当成未知错误
-                    else if(WEXITSTATUS(status) == 1)
-                    {
-                        return -3;
-                    }
-                    else
-                    {
-                        return WEXITSTATUS(status);
-                    }
+                    return 0;
                 }
-                else // 非正常结束
+                // 触发SIGALRM，当成触发 SIGXCPU
+                else if(WEXITSTATUS(status) == SIGALRM)
                 {
-                    LOG(INFO) << "代码运行完毕，info：" << WTERMSIG(status) << std::endl;
-                    return WTERMSIG(status);
+                    return SIGXCPU;
                 }
+                // 子进程程序替换失败，即用户程序未能运行起来，当成未知错误
+                else if(WEXITSTATUS(status) == 1)
+                {
+                    return -3;
+                }
+                else
+                {
+                    return WEXITSTATUS(status);
+                }
+            }
+            else // 非正常结束
+            {
+                LOG(INFO) << "代码运行完毕，info：" << WTERMSIG(status) << std::endl;
+                return WTERMSIG(status);
             }
         }
     };
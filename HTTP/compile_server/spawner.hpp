@@ -0,0 +1,277 @@
+/*
+* 子进程创建模块
+* 编译与运行都需要创建子进程，服务本身是多线程的httplib服务器
+* fork会复制整个服务进程的页表，耗时随内存占用与线程数增长
+* 默认使用 clone(CLONE_VM | CLONE_VFORK)：子进程与父进程共享地址空间，exec后父进程才继续执行
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <csignal>
+#include <cerrno>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "../comm/log.hpp"
+
+namespace ns_spawner
+{
+    using namespace ns_log;
+
+    enum class SpawnMode
+    {
+        Fork,  // fork + exec，复制父进程页表
+        VFork, // clone(CLONE_VM | CLONE_VFORK) + exec，不复制页表
+    };
+
+    // 子进程的启动参数，全部在父进程中准备好，子进程中只做系统调用
+    struct SpawnOptions
+    {
+        std::vector<std::string> args;             // 参数列表，exeFd < 0 时按 args[0] 在PATH中查找程序
+        std::vector<std::string> envs;             // 环境变量，为空时继承当前进程
+        int exeFd = -1;                            // 通过fexecve执行的程序
+        std::vector<std::pair<int, int>> redirects; // (fd, 目标fd)，子进程中 dup2(fd, 目标fd)
+        rlim_t cpuLimit = 0;                       // CPU上限 (s)，0为不限制
+        rlim_t memLimit = 0;                       // 地址空间上限 (B)，0为不限制
+        int cgroupFd = -1;                         // cgroup.procs的fd，子进程exec之前写入"0"加入该cgroup
+    };
+
+    const size_t spawnStackSize = 256 * 1024; // vfork子进程使用的栈大小
+
+    class Spawner
+    {
+    private:
+        // 子进程可见的参数，只包含裸指针与整数
+        struct ChildArgs
+        {
+            char *const *argv;
+            char *const *envp;
+            int exeFd;
+            const std::pair<int, int> *redirects;
+            size_t redirectNum;
+            rlim_t cpuLimit;
+            rlim_t memLimit;
+            int cgroupFd;
+            const sigset_t *oldMask;
+            int errPipe; // exec失败时写入errno
+        };
+
+    public:
+        /**
+         * @brief 设置创建子进程的方式，服务启动时、处理请求之前调用
+         *
+         */
+        static void SetMode(SpawnMode mode)
+        {
+            Mode() = mode;
+        }
+        static SpawnMode GetMode()
+        {
+            return Mode();
+        }
+
+        /**
+         * @brief 创建子进程并执行程序
+         * return：子进程pid，失败时为-1，errno为失败原因
+         *
+         * 程序替换失败时，子进程已被回收，返回-1
+         * 重定向使用的fd由调用者关闭
+         */
+        static pid_t Spawn(const SpawnOptions &opt)
+        {
+            std::vector<char *> argv = ToArgv(opt.args);
+            std::vector<char *> envp = ToArgv(opt.envs);
+
+            int errPipe[2];
+            if (0 != pipe2(errPipe, O_CLOEXEC))
+            {
+                return -1;
+            }
+
+            // 子进程重置信号处理函数前，不能响应任何信号
+            sigset_t all, oldMask;
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &oldMask);
+
+            ChildArgs args;
+            args.argv = argv.data();
+            args.envp = opt.envs.empty() ? environ : envp.data();
+            args.exeFd = opt.exeFd;
+            args.redirects = opt.redirects.data();
+            args.redirectNum = opt.redirects.size();
+            args.cpuLimit = opt.cpuLimit;
+            args.memLimit = opt.memLimit;
+            args.cgroupFd = opt.cgroupFd;
+            args.oldMask = &oldMask;
+            args.errPipe = errPipe[1];
+
+            pid_t pid = -1;
+            int spawnErrno = 0;
+            if (SpawnMode::Fork == Mode())
+            {
+                pid = fork();
+                if (0 == pid)
+                {
+                    ChildMain(&args);
+                }
+            }
+            else
+            {
+                void *stack = mmap(nullptr, spawnStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+                if (stack != MAP_FAILED)
+                {
+                    // 栈向低地址增长，传入栈顶；CLONE_VFORK保证子进程exec或退出后才返回
+                    pid = clone(ChildMain, static_cast<char *>(stack) + spawnStackSize, CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+                    spawnErrno = errno;
+                    munmap(stack, spawnStackSize);
+                }
+                else
+                {
+                    spawnErrno = errno;
+                }
+            }
+            if (pid < 0 && 0 == spawnErrno)
+            {
+                spawnErrno = errno;
+            }
+
+            pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+            close(errPipe[1]);
+
+            if (pid < 0)
+            {
+                close(errPipe[0]);
+                LOG(ERROR) << "创建子进程失败，errno：" << spawnErrno << std::endl;
+                errno = spawnErrno;
+                return -1;
+            }
+
+            // exec成功时管道随CLOEXEC关闭，读到EOF；失败时读到子进程的errno
+            int childErrno = 0;
+            ssize_t n;
+            do
+            {
+                n = read(errPipe[0], &childErrno, sizeof childErrno);
+            } while (n < 0 && errno == EINTR);
+            close(errPipe[0]);
+            if (n == sizeof childErrno)
+            {
+                waitpid(pid, nullptr, 0);
+                LOG(ERROR) << "子进程程序替换失败，errno：" << childErrno << std::endl;
+                errno = childErrno;
+                return -1;
+            }
+            return pid;
+        }
+
+        /**
+         * @brief 转换为exec系列函数需要的以nullptr结尾的参数数组
+         *
+         */
+        static std::vector<char *> ToArgv(const std::vector<std::string> &args)
+        {
+            std::vector<char *> argv;
+            for (auto &arg : args)
+            {
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            return argv;
+        }
+
+    private:
+        static SpawnMode &Mode()
+        {
+            static SpawnMode mode = SpawnMode::VFork;
+            return mode;
+        }
+
+        /**
+         * @brief 子进程入口
+         * vfork模式下与父进程共享内存，只能调用异步信号安全的函数，不能分配内存
+         */
+        static int ChildMain(void *arg)
+        {
+            const ChildArgs *args = static_cast<const ChildArgs *>(arg);
+
+            // 恢复默认的信号处理方式，服务进程忽略的SIGPIPE等信号不应影响子进程
+            struct sigaction sa;
+            for (int sig = 1; sig < NSIG; sig++)
+            {
+                if (0 == sigaction(sig, nullptr, &sa) && sa.sa_handler != SIG_DFL)
+                {
+                    sa.sa_handler = SIG_DFL;
+                    sa.sa_flags = 0;
+                    sigaction(sig, &sa, nullptr);
+                }
+            }
+            sigprocmask(SIG_SETMASK, args->oldMask, nullptr);
+
+            // 重定向，dup2到新的fd会清除CLOEXEC
+            for (size_t i = 0; i < args->redirectNum; i++)
+            {
+                int from = args->redirects[i].first;
+                int to = args->redirects[i].second;
+                if (from == to)
+                {
+                    fcntl(to, F_SETFD, 0);
+                }
+                else if (dup2(from, to) < 0)
+                {
+                    Fail(args);
+                }
+            }
+
+            // 资源约束
+            if (args->cgroupFd >= 0 && write(args->cgroupFd, "0", 1) != 1)
+            {
+                Fail(args);
+            }
+            if (args->cpuLimit > 0)
+            {
+                struct rlimit cpuR = {args->cpuLimit, RLIM_INFINITY};
+                setrlimit(RLIMIT_CPU, &cpuR);
+            }
+            if (args->memLimit > 0)
+            {
+                struct rlimit memR = {args->memLimit, RLIM_INFINITY};
+                setrlimit(RLIMIT_AS, &memR);
+            }
+
+            if (args->exeFd >= 0)
+            {
+                // 其他线程fork出的子进程在exec前可能短暂持有可执行文件的可写引用，此时返回ETXTBSY，稍后重试
+                for (int i = 0; i < 100; i++)
+                {
+                    fexecve(args->exeFd, args->argv, args->envp);
+                    if (errno != ETXTBSY)
+                        break;
+                    usleep(1000);
+                }
+            }
+            else
+            {
+                execvpe(args->argv[0], args->argv, args->envp);
+            }
+            Fail(args);
+            return 0;
+        }
+
+        static void Fail(const ChildArgs *args)
+        {
+            int err = errno;
+            ssize_t n = write(args->errPipe, &err, sizeof err);
+            (void)n;
+            _exit(127);
+        }
+    };
+}
@@ -0,0 +1,449 @@
+/*
+* 运行监控
+* 所有用户程序由一个epoll线程集中监控：pidfd(或zygote的回复socket)可读表示程序已退出，
+* 墙钟时间由timerfd计时，CPU时间在timerfd到期时读取进程的CPU时钟检查，限制精确到毫秒
+* 超过限制的程序被SIGKILL，不再依赖测试框架自己调用alarm，RLIMIT_CPU只作为兜底
+* 程序的标准输出/标准错误管道也在该线程中读取，程序退出后在该线程中回调，启动程序的线程不等待程序结束
+* 因此同时运行的程序数与线程数无关，几个线程即可启动、处理数百个并发运行
+* 输出读入内存，总量超过上限时截断并终止程序，死循环输出不会占满内存或磁盘
+* 程序退出时通过wait4得到CPU时间与内存峰值，墙钟时间从提交监控时开始计算
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+
+#include "../comm/log.hpp"
+#include "../comm/util.hpp"
+
+namespace ns_supervisor
+{
+    using namespace ns_log;
+    using namespace ns_util;
+
+    const int supervisorPollMs = 10;   // 内核不支持pidfd时检查程序是否退出的间隔 (ms)
+    const int cpuCheckMaxMs = 100;     // 两次检查CPU时间的最大间隔 (ms)，多线程程序的CPU时间可能快于墙钟时间
+    const int supervisorMaxEvents = 64;
+
+    // 程序被终止的原因
+    enum class KillReason
+    {
+        None,
+        CpuLimit,  // CPU时间超出限制
+        WallLimit, // 墙钟时间超出限制(如sleep、等待输入)
+        OutputLimit, // 输出超出限制
+    };
+
+    // 监控一个程序所需的信息，其中的fd都由监控线程关闭
+    struct WatchOptions
+    {
+        pid_t pid = -1;                     // 超出限制时向其发送SIGKILL，并读取其CPU时钟
+        int pidFd = -1;                     // 可为-1，存在时通过它发送信号
+        int exitFd = -1;                    // 程序退出后可读的fd(pidfd或zygote的回复socket)，-1时每 supervisorPollMs 检查一次
+        std::function<bool(int *, struct rusage *)> reap; // 非阻塞地获取退出状态与资源使用，返回真表示已退出
+        int outFd = -1;                     // 标准输出/标准错误管道的读端，可为-1
+        int errFd = -1;
+        int cpuLimitMs = 0;                 // CPU时间上限 (ms)，0为不限制
+        int wallLimitMs = 0;                // 墙钟时间上限 (ms)，0为不限制
+        size_t outputLimit = 0;             // 标准输出与标准错误合计的字节数上限，0为不限制
+    };
+
+    /*
+    * 程序的资源使用
+    * 内存峰值来自rusage，包含exec之前的部分：zygote的子进程约1MB，小于任何C++程序，结果准确；
+    * 由服务进程直接创建(vfork/fork)时至少为服务进程当时的内存占用
+    */
+    struct RunUsage
+    {
+        long cpuMs = 0;     // 用户态+内核态CPU时间 (ms)
+        long wallMs = 0;    // 墙钟时间 (ms)
+        long peakRssKB = 0; // 内存峰值 (KB)
+        long outputBytes = 0; // 读到的标准输出与标准错误字节数，截断时为上限
+    };
+
+    struct WatchResult
+    {
+        int status = 0; // waitpid得到的状态
+        KillReason killed = KillReason::None;
+        bool truncated = false; // 输出超出上限，out/err只保留了前面的部分
+        RunUsage usage;
+        std::string out;
+        std::string err;
+    };
+
+    class Supervisor
+    {
+    private:
+        // epoll事件中fd的用途，与监控编号一起放入 epoll_event.data.u64
+        enum Role
+        {
+            RoleExit,
+            RoleOut,
+            RoleErr,
+            RoleWall,
+            RoleCheck,
+            RoleNum,
+        };
+
+        struct Entry
+        {
+            uint64_t id;
+            WatchOptions opt;
+            std::function<void(WatchResult &)> done;
+            int wallTimer = -1;
+            int checkTimer = -1; // 检查CPU时间，pollExit时同时检查是否退出
+            bool pollExit = false; // 没有可监听的退出事件，每 supervisorPollMs 调用一次reap
+            bool hasCpuClock = false;
+            clockid_t cpuClock;
+            std::chrono::steady_clock::time_point start;
+            struct rusage ru;
+            WatchResult result;
+        };
+
+        Supervisor() : _epollFd(-1), _wakeFd(-1), _nextId(1)
+        {
+            _epollFd = epoll_create1(EPOLL_CLOEXEC);
+            _wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (_epollFd < 0 || _wakeFd < 0)
+            {
+                LOG(FATAL) << "运行监控初始化失败，errno：" << errno << std::endl;
+                exit(1);
+            }
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = 0; // 监控编号从1开始，0为唤醒事件
+            epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &ev);
+            std::thread(&Supervisor::Loop, this).detach();
+        }
+        Supervisor(const Supervisor &) = delete;
+        Supervisor &operator=(const Supervisor &) = delete;
+
+    public:
+        static Supervisor &GetInstance()
+        {
+            static Supervisor supervisor;
+            return supervisor;
+        }
+
+        /**
+         * @brief 开始监控一个已启动的程序，立即返回
+         * done：程序退出、管道读完后在监控线程中调用，应尽快返回，耗时的处理交回其他线程
+         */
+        void Watch(const WatchOptions &opt, const std::function<void(WatchResult &)> &done)
+        {
+            std::unique_ptr<Entry> entry(new Entry);
+            entry->opt = opt;
+            entry->done = done;
+            entry->start = std::chrono::steady_clock::now();
+            memset(&entry->ru, 0, sizeof entry->ru);
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                entry->id = _nextId++;
+                _pending.push_back(std::move(entry));
+            }
+            uint64_t one = 1;
+            ssize_t n = write(_wakeFd, &one, sizeof one);
+            (void)n;
+        }
+
+    private:
+        void Loop()
+        {
+            struct epoll_event events[supervisorMaxEvents];
+            while (true)
+            {
+                int n = epoll_wait(_epollFd, events, supervisorMaxEvents, -1);
+                for (int i = 0; i < n; i++)
+                {
+                    uint64_t data = events[i].data.u64;
+                    if (0 == data)
+                    {
+                        uint64_t cnt;
+                        ssize_t r = read(_wakeFd, &cnt, sizeof cnt);
+                        (void)r;
+                        AddPending();
+                        continue;
+                    }
+                    auto iter = _entries.find(data / RoleNum);
+                    if (iter == _entries.end()) // 同一批事件中已结束
+                    {
+                        continue;
+                    }
+                    Handle(iter->second.get(), static_cast<Role>(data % RoleNum));
+                }
+            }
+        }
+
+        void AddPending()
+        {
+            std::vector<std::unique_ptr<Entry>> pending;
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                pending.swap(_pending);
+            }
+            for (auto &entry : pending)
+            {
+                Entry *e = entry.get();
+                _entries[e->id] = std::move(entry);
+                Register(e);
+            }
+        }
+
+        void Register(Entry *e)
+        {
+            WatchOptions &opt = e->opt;
+            for (int fd : {opt.outFd, opt.errFd})
+            {
+                if (fd >= 0)
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            }
+            if (opt.outFd >= 0 && !Add(e, opt.outFd, RoleOut))
+                CloseFd(&opt.outFd);
+            if (opt.errFd >= 0 && !Add(e, opt.errFd, RoleErr))
+                CloseFd(&opt.errFd);
+            e->pollExit = opt.exitFd < 0 || !Add(e, opt.exitFd, RoleExit);
+
+            if (opt.cpuLimitMs > 0)
+            {
+                e->hasCpuClock = 0 == clock_getcpuclockid(opt.pid, &e->cpuClock);
+            }
+            if (opt.wallLimitMs > 0)
+            {
+                e->wallTimer = NewTimer(e, RoleWall, opt.wallLimitMs);
+            }
+            int checkMs = NextCheckMs(e, 0);
+            if (checkMs > 0)
+            {
+                e->checkTimer = NewTimer(e, RoleCheck, checkMs);
+            }
+        }
+
+        void Handle(Entry *e, Role role)
+        {
+            WatchOptions &opt = e->opt;
+            switch (role)
+            {
+            case RoleExit:
+                if (opt.reap(&e->result.status, &e->ru))
+                {
+                    Finish(e);
+                }
+                break;
+            case RoleOut:
+                ReadPipe(e, &opt.outFd, &e->result.out, false);
+                break;
+            case RoleErr:
+                ReadPipe(e, &opt.errFd, &e->result.err, false);
+                break;
+            case RoleWall:
+                Kill(e, KillReason::WallLimit);
+                break;
+            case RoleCheck:
+            {
+                uint64_t cnt;
+                ssize_t r = read(e->checkTimer, &cnt, sizeof cnt);
+                (void)r;
+                if (e->pollExit && opt.reap(&e->result.status, &e->ru))
+                {
+                    Finish(e);
+                    break;
+                }
+                long usedMs = 0;
+                if (e->hasCpuClock && e->result.killed == KillReason::None)
+                {
+                    struct timespec ts;
+                    if (0 == clock_gettime(e->cpuClock, &ts))
+                        usedMs = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+                    if (usedMs >= opt.cpuLimitMs)
+                    {
+                        Kill(e, KillReason::CpuLimit);
+                    }
+                }
+                int checkMs = NextCheckMs(e, usedMs);
+                if (checkMs > 0)
+                {
+                    SetTimer(e->checkTimer, checkMs);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        /**
+         * @brief 下一次检查的间隔，0为不再检查
+         * CPU时间不会快于墙钟时间(单线程)，剩余的CPU时间用完之前不必检查
+         */
+        int NextCheckMs(Entry *e, long usedMs)
+        {
+            int checkMs = 0;
+            if (e->hasCpuClock && e->result.killed == KillReason::None)
+            {
+                checkMs = std::max<int>(1, std::min<long>(e->opt.cpuLimitMs - usedMs, cpuCheckMaxMs));
+            }
+            if (e->pollExit)
+            {
+                checkMs = checkMs > 0 ? std::min(checkMs, supervisorPollMs) : supervisorPollMs;
+            }
+            return checkMs;
+        }
+
+        void Kill(Entry *e, KillReason reason)
+        {
+            if (e->result.killed != KillReason::None)
+            {
+                return;
+            }
+            e->result.killed = reason;
+            SysUtil::SendSignal(e->opt.pid, e->opt.pidFd, SIGKILL);
+            Remove(&e->wallTimer);
+            const char *what = reason == KillReason::CpuLimit ? "CPU时间" : reason == KillReason::WallLimit ? "墙钟时间" : "输出";
+            LOG(INFO) << "程序超出" << what << "限制，已终止，pid：" << e->opt.pid << std::endl;
+        }
+
+        /**
+         * @brief 读取管道中已有的数据
+         * exited：程序已退出，读完已有数据后关闭，不再等待其子进程写入
+         * 超出输出上限时只保留上限以内的部分，关闭两个管道，程序未退出时终止程序
+         */
+        void ReadPipe(Entry *e, int *fd, std::string *buf, bool exited)
+        {
+            WatchOptions &opt = e->opt;
+            WatchResult &result = e->result;
+            char tmp[4096];
+            ssize_t r;
+            while ((r = read(*fd, tmp, sizeof tmp)) > 0)
+            {
+                size_t used = result.out.size() + result.err.size();
+                if (opt.outputLimit > 0 && used + r > opt.outputLimit)
+                {
+                    buf->append(tmp, opt.outputLimit - used);
+                    result.truncated = true;
+                    Remove(&opt.outFd);
+                    Remove(&opt.errFd);
+                    if (!exited)
+                        Kill(e, KillReason::OutputLimit);
+                    return;
+                }
+                buf->append(tmp, r);
+            }
+            if (r == 0 || exited || (r < 0 && errno != EAGAIN && errno != EINTR))
+            {
+                Remove(fd);
+            }
+        }
+
+        /**
+         * @brief 程序已退出，读完管道、释放资源后回调
+         *
+         */
+        void Finish(Entry *e)
+        {
+            WatchOptions &opt = e->opt;
+            RunUsage &usage = e->result.usage;
+            usage.wallMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - e->start).count();
+            usage.cpuMs = (e->ru.ru_utime.tv_sec + e->ru.ru_stime.tv_sec) * 1000 + (e->ru.ru_utime.tv_usec + e->ru.ru_stime.tv_usec) / 1000;
+            usage.peakRssKB = e->ru.ru_maxrss;
+            if (opt.outFd >= 0)
+                ReadPipe(e, &opt.outFd, &e->result.out, true);
+            if (opt.errFd >= 0)
+                ReadPipe(e, &opt.errFd, &e->result.err, true);
+            usage.outputBytes = e->result.out.size() + e->result.err.size();
+            Remove(&e->wallTimer);
+            Remove(&e->checkTimer);
+            if (opt.exitFd >= 0 && opt.exitFd != opt.pidFd)
+                Remove(&opt.exitFd);
+            Remove(&opt.pidFd);
+
+            std::unique_ptr<Entry> entry = std::move(_entries[e->id]);
+            _entries.erase(e->id);
+            entry->done(entry->result);
+        }
+
+        bool Add(Entry *e, int fd, Role role)
+        {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = e->id * RoleNum + role;
+            if (0 != epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev))
+            {
+                LOG(WARNING) << "运行监控注册fd失败，errno：" << errno << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief 移除并关闭fd
+         * 管道、socket在子进程中还有引用，关闭前必须从epoll中移除，否则仍会产生事件
+         */
+        void Remove(int *fd)
+        {
+            if (*fd >= 0)
+            {
+                epoll_ctl(_epollFd, EPOLL_CTL_DEL, *fd, nullptr);
+            }
+            CloseFd(fd);
+        }
+
+        static void CloseFd(int *fd)
+        {
+            if (*fd >= 0)
+            {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+
+        int NewTimer(Entry *e, Role role, int ms)
+        {
+            int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+            if (fd < 0 || !SetTimer(fd, ms) || !Add(e, fd, role))
+            {
+                LOG(WARNING) << "运行监控创建定时器失败，errno：" << errno << std::endl;
+                if (fd >= 0)
+                    close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        static bool SetTimer(int fd, int ms)
+        {
+            struct itimerspec its;
+            its.it_interval = {0, 0};
+            its.it_value.tv_sec = ms / 1000;
+            its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+            return 0 == timerfd_settime(fd, 0, &its, nullptr);
+        }
+
+    private:
+        int _epollFd;
+        int _wakeFd; // 其他线程提交监控后唤醒epoll
+        std::mutex _mtx;
+        uint64_t _nextId;
+        std::vector<std::unique_ptr<Entry>> _pending;                 // 已提交、尚未注册的监控，_mtx保护
+        std::unordered_map<uint64_t, std::unique_ptr<Entry>> _entries; // 只在监控线程中访问
+    };
+}
@@ -0,0 +1,239 @@
+/*
+* 测试数据模块
+* 数据驱动的题目不在tail.cpp中写测试用例，而是提供若干组 输入/期望输出
+* 每组输入按 题号+版本 只写入一次memfd并封印为只读，之后每次运行以它作为程序的标准输入：
+*   版本由oj_server加载题目时计算，请求只携带版本，缓存未命中时oj_server再发送数据
+*   程序可以直接read或mmap标准输入，数据留在内存中，不经管道逐段写入，也不落盘
+*   并发运行的程序各自重新打开memfd，读取位置互不影响；封印后程序无法通过/proc修改测试数据
+* 程序的输出由编译服务与期望输出比对
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <jsoncpp/json/json.h>
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+namespace ns_test_data
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    // 一组测试用例
+    struct TestCase
+    {
+        int inFd = -1;      // 只读封印的memfd，保存输入
+        std::string expect; // 期望输出
+    };
+
+    // 一道题目某个版本的全部测试用例，更新版本时正在运行的任务仍持有旧版本
+    class TestSet
+    {
+    public:
+        TestSet() {}
+        ~TestSet()
+        {
+            for (auto &tc : _cases)
+            {
+                if (tc.inFd >= 0)
+                    close(tc.inFd);
+            }
+        }
+        TestSet(const TestSet &) = delete;
+        TestSet &operator=(const TestSet &) = delete;
+
+        /**
+         * @brief 添加一组用例，输入写入memfd后封印
+         *
+         */
+        bool Add(const std::string &input, const std::string &expect)
+        {
+            int fd = memfd_create("input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0)
+            {
+                LOG(ERROR) << "创建memfd失败" << "\n";
+                return false;
+            }
+            size_t done = 0;
+            while (done < input.size())
+            {
+                ssize_t n = write(fd, input.data() + done, input.size() - done);
+                if (n <= 0)
+                {
+                    close(fd);
+                    LOG(ERROR) << "写入测试输入失败" << "\n";
+                    return false;
+                }
+                done += n;
+            }
+            if (0 != fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))
+            {
+                close(fd);
+                LOG(ERROR) << "封印测试输入失败" << "\n";
+                return false;
+            }
+            _cases.push_back(TestCase());
+            _cases.back().inFd = fd;
+            _cases.back().expect = expect;
+            return true;
+        }
+
+        size_t Size() const
+        {
+            return _cases.size();
+        }
+
+        const std::string &Expect(size_t i) const
+        {
+            return _cases[i].expect;
+        }
+
+        /**
+         * @brief 打开第i组输入，作为程序的标准输入，由调用者关闭
+         * 每次重新打开得到独立的读取位置
+         */
+        int OpenInput(size_t i) const
+        {
+            return open(("/proc/self/fd/" + std::to_string(_cases[i].inFd)).c_str(), O_RDONLY | O_CLOEXEC);
+        }
+
+        /**
+         * @brief 比对程序输出与期望输出，忽略每行末尾的空白与末尾的空行
+         *
+         */
+        static bool Match(const std::string &out, const std::string &expect)
+        {
+            size_t i = 0, j = 0;
+            while (true)
+            {
+                std::string a, b;
+                bool hasA = NextLine(out, &i, &a);
+                bool hasB = NextLine(expect, &j, &b);
+                if (!hasA && !hasB)
+                {
+                    return true;
+                }
+                if (a != b)
+                {
+                    return false;
+                }
+            }
+        }
+
+    private:
+        /**
+         * @brief 取出下一行，去掉末尾空白；其后只剩空白时返回假
+         *
+         */
+        static bool NextLine(const std::string &s, size_t *pos, std::string *line)
+        {
+            if (s.find_first_not_of(" \t\r\n", *pos) == std::string::npos)
+            {
+                *pos = s.size();
+                return false;
+            }
+            size_t end = s.find('\n', *pos);
+            if (end == std::string::npos)
+            {
+                end = s.size();
+            }
+            *line = s.substr(*pos, end - *pos);
+            line->erase(line->find_last_not_of(" \t\r") + 1);
+            *pos = end + 1;
+            return true;
+        }
+
+    private:
+        std::vector<TestCase> _cases;
+    };
+
+    class TestDataCache
+    {
+    private:
+        struct Entry
+        {
+            std::string version; // 全部输入与期望输出的哈希，由oj_server计算
+            std::shared_ptr<const TestSet> tests;
+        };
+
+    public:
+        /**
+         * @brief 全局唯一的测试数据缓存
+         *
+         */
+        static TestDataCache &GetInstance()
+        {
+            static TestDataCache instance;
+            return instance;
+        }
+        TestDataCache(const TestDataCache &) = delete;
+        TestDataCache &operator=(const TestDataCache &) = delete;
+
+        /**
+         * @brief 获取题目的测试用例，版本变化时重新写入
+         * number：题目编号
+         * version：测试数据的版本，为空时按tests计算
+         * tests：测试用例数组，每一项为 {"input":输入, "output":期望输出}，缓存命中时不读取
+         * return：缓存未命中且没有tests，或写入失败时为nullptr
+         */
+        std::shared_ptr<const TestSet> Get(const std::string &number, std::string version, const Json::Value &tests)
+        {
+            if (version.empty())
+            {
+                std::string data;
+                for (const auto &tc : tests)
+                {
+                    data += tc["input"].asString();
+                    data += '\0';
+                    data += tc["output"].asString();
+                    data += '\0';
+                }
+                version = StringUtil::HashToHex(data);
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                auto iter = _entries.find(number);
+                if (iter != _entries.end() && iter->second.version == version)
+                {
+                    return iter->second.tests;
+                }
+            }
+            if (!tests.isArray() || tests.empty())
+            {
+                return nullptr;
+            }
+
+            // 并发的首次请求可能各自写入一次，以最后写入的为准
+            std::shared_ptr<TestSet> set = std::make_shared<TestSet>();
+            for (const auto &tc : tests)
+            {
+                if (!set->Add(tc["input"].asString(), tc["output"].asString()))
+                {
+                    LOG(ERROR) << "加载测试数据失败，题目：" << number << std::endl;
+                    return nullptr;
+                }
+            }
+            LOG(INFO) << "加载测试数据成功，题目：" << number << "，版本：" << version << "，用例：" << set->Size() << std::endl;
+            std::lock_guard<std::mutex> lock(_mtx);
+            _entries[number] = Entry{version, set};
+            return set;
+        }
+
+    private:
+        TestDataCache() {}
+
+    private:
+        std::unordered_map<std::string, Entry> _entries; // 题号->测试用例
+        std::mutex _mtx;
+    };
+}
@@ -0,0 +1,611 @@
+/*
+* 运行进程池(zygote)
+* 服务启动时、创建任何线程之前，fork出一个常驻的小进程(zygote)
+* zygote预先fork好若干子进程，子进程已完成信号、工作目录等准备工作，阻塞等待任务
+* 运行用户程序时，服务把 程序+标准输入输出fd+资源限制 通过socketpair交给zygote，
+* 由空闲的子进程直接exec，进程创建不再位于判题的关键路径上，也不需要复制服务进程
+* 子进程开始执行时，zygote先回复其pid与pidfd，服务据此监控、终止子进程；子进程退出后再回复退出状态
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "../comm/log.hpp"
+#include "../comm/util.hpp"
+#include "./spawner.hpp"
+
+namespace ns_zygote
+{
+    using namespace ns_log;
+    using namespace ns_util;
+    using namespace ns_spawner;
+
+    class Zygote
+    {
+    private:
+        // 服务->zygote->子进程 的任务描述，fd通过SCM_RIGHTS传递：stdin, stdout, stderr, [回复socket], [可执行程序], [cgroup.procs]
+        struct Request
+        {
+            rlim_t cpuLimit;
+            rlim_t memLimit;
+            int hasExeFd;            // 为真时通过fexecve执行传入的fd，否则执行exePath
+            int hasCgroupFd;         // 为真时exec之前向传入的cgroup.procs写入"0"
+            char exePath[PATH_MAX];
+        };
+        // zygote->服务 的运行结果
+        struct Reply
+        {
+            pid_t pid;
+            int status;  // waitpid得到的状态
+            int err;     // 非0表示程序替换失败
+            int started; // 为真表示子进程已开始执行(附带pidfd)，随后还有一条退出状态
+            struct rusage usage;
+        };
+        // 已分配任务的子进程
+        struct Busy
+        {
+            int replyFd;
+            int channel;
+        };
+        // 预先创建的空闲子进程
+        struct Idle
+        {
+            pid_t pid;
+            int channel;
+        };
+
+        static const int maxFds = 6;
+
+    public:
+        /**
+         * @brief 启动zygote进程
+         * poolSize：预先创建的子进程数量，0为不启用
+         * 必须在创建任何线程之前调用
+         */
+        static bool Start(int poolSize)
+        {
+            if (poolSize <= 0)
+            {
+                return false;
+            }
+            int sv[2];
+            if (0 != socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+            {
+                LOG(ERROR) << "创建zygote通信socket失败" << std::endl;
+                return false;
+            }
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                close(sv[0]);
+                close(sv[1]);
+                LOG(ERROR) << "创建zygote进程失败" << std::endl;
+                return false;
+            }
+            if (0 == pid)
+            {
+                close(sv[0]);
+                Loop(sv[1], poolSize);
+                _exit(0);
+            }
+            close(sv[1]);
+            Sock() = sv[0];
+            LOG(INFO) << "zygote启动成功，pid：" << pid << "，进程池大小：" << poolSize << std::endl;
+            return true;
+        }
+
+        static bool Enabled()
+        {
+            return Sock() >= 0;
+        }
+
+        /**
+         * @brief 提交任务
+         * opt：需要重定向 0、1、2，exeFd 或 args[0] 指定程序
+         * return：接收结果的fd，失败时为-1(调用者可改用Spawner)
+         */
+        static int Submit(const SpawnOptions &opt)
+        {
+            int stdFds[3] = {-1, -1, -1};
+            for (const auto &r : opt.redirects)
+            {
+                if (r.second >= 0 && r.second < 3)
+                    stdFds[r.second] = r.first;
+            }
+            if (stdFds[0] < 0 || stdFds[1] < 0 || stdFds[2] < 0)
+            {
+                return -1;
+            }
+
+            Request req;
+            memset(&req, 0, sizeof req);
+            req.cpuLimit = opt.cpuLimit;
+            req.memLimit = opt.memLimit;
+            req.hasExeFd = opt.exeFd >= 0;
+            req.hasCgroupFd = opt.cgroupFd >= 0;
+            if (!req.hasExeFd)
+            {
+                if (opt.args.empty() || opt.args[0].size() >= sizeof req.exePath)
+                    return -1;
+                strcpy(req.exePath, opt.args[0].c_str());
+            }
+
+            int reply[2];
+            if (0 != socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, reply))
+            {
+                return -1;
+            }
+            std::vector<int> fds = {stdFds[0], stdFds[1], stdFds[2], reply[1]};
+            if (req.hasExeFd)
+                fds.push_back(opt.exeFd);
+            if (req.hasCgroupFd)
+                fds.push_back(opt.cgroupFd);
+
+            bool ok = SendFds(Sock(), &req, sizeof req, fds);
+            close(reply[1]);
+            if (!ok)
+            {
+                close(reply[0]);
+                LOG(WARNING) << "向zygote提交任务失败，errno：" << errno << std::endl;
+                return -1;
+            }
+            return reply[0];
+        }
+
+        /**
+         * @brief 等待子进程开始执行，Submit之后、Wait之前调用
+         * pid/pidFd：输出型参数，pidFd由调用者关闭，内核不支持pidfd时为-1
+         * status：未能开始执行时的状态，含义与Wait相同
+         * return：为假表示任务未能开始执行(无可用子进程、zygote异常退出)，不再需要Wait
+         */
+        static bool Started(int replyFd, pid_t *pid, int *pidFd, int *status)
+        {
+            Reply rep;
+            std::vector<int> fds;
+            ssize_t n = RecvFds(replyFd, &rep, sizeof rep, &fds);
+            *pidFd = -1;
+            if (n != sizeof rep || !rep.started)
+            {
+                CloseAll(fds);
+                LOG(ERROR) << "zygote未能执行任务，errno：" << (n == sizeof rep ? rep.err : errno) << std::endl;
+                *status = W_EXITCODE(1, 0);
+                return false;
+            }
+            *pid = rep.pid;
+            if (!fds.empty())
+            {
+                *pidFd = fds[0];
+                fds.erase(fds.begin());
+                CloseAll(fds);
+            }
+            return true;
+        }
+
+        /**
+         * @brief 获取任务结果
+         * replyFd：Submit的返回值，由调用者关闭
+         * block：是否阻塞等待
+         * status：输出型参数，与waitpid的状态含义相同
+         * usage：输出型参数(可为nullptr)，子进程的资源使用，与wait4的含义相同
+         * return：真为已结束
+         *
+         * 程序替换失败、zygote异常退出时，视为以1退出(Runner中的程序替换失败)
+         */
+        static bool Wait(int replyFd, bool block, int *status, struct rusage *usage = nullptr)
+        {
+            Reply rep;
+            ssize_t n;
+            do
+            {
+                n = recv(replyFd, &rep, sizeof rep, block ? 0 : MSG_DONTWAIT);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return false;
+            }
+            if (n != sizeof rep)
+            {
+                LOG(ERROR) << "zygote未返回运行结果" << std::endl;
+                *status = W_EXITCODE(1, 0);
+                return true;
+            }
+            if (rep.err != 0)
+            {
+                LOG(ERROR) << "zygote子进程程序替换失败，errno：" << rep.err << std::endl;
+                *status = W_EXITCODE(1, 0);
+                return true;
+            }
+            *status = rep.status;
+            if (usage)
+                *usage = rep.usage;
+            return true;
+        }
+
+    private:
+        static int &Sock()
+        {
+            static int sock = -1;
+            return sock;
+        }
+
+        static bool SendFds(int sock, const void *data, size_t len, const std::vector<int> &fds)
+        {
+            struct iovec iov;
+            iov.iov_base = const_cast<void *>(data);
+            iov.iov_len = len;
+            char ctrl[CMSG_SPACE(sizeof(int) * maxFds)];
+            memset(ctrl, 0, sizeof ctrl);
+            struct msghdr msg;
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if (!fds.empty())
+            {
+                msg.msg_control = ctrl;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+                memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+            }
+            ssize_t n;
+            do
+            {
+                n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+            return n == (ssize_t)len;
+        }
+
+        /**
+         * @brief 接收消息与fd
+         * return：消息长度，0为对端关闭，-1为出错
+         */
+        static ssize_t RecvFds(int sock, void *data, size_t len, std::vector<int> *fds)
+        {
+            struct iovec iov;
+            iov.iov_base = data;
+            iov.iov_len = len;
+            char ctrl[CMSG_SPACE(sizeof(int) * maxFds)];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof ctrl;
+            ssize_t n;
+            do
+            {
+                n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            } while (n < 0 && errno == EINTR);
+            fds->clear();
+            if (n <= 0)
+            {
+                return n;
+            }
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                {
+                    size_t cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    int *p = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+                    fds->insert(fds->end(), p, p + cnt);
+                }
+            }
+            return n;
+        }
+
+        /**
+         * @brief 关闭 >= lowFd 的所有fd
+         *
+         */
+        static void CloseFrom(int lowFd)
+        {
+#ifdef SYS_close_range
+            if (0 == syscall(SYS_close_range, lowFd, ~0U, 0))
+                return;
+#endif
+            for (int fd = lowFd; fd < 1024; fd++)
+                close(fd);
+        }
+
+        static void CloseAll(const std::vector<int> &fds)
+        {
+            for (int fd : fds)
+                close(fd);
+        }
+
+        /**
+         * @brief zygote主循环
+         * sock：与服务通信的socket，服务退出后zygote随之退出
+         */
+        static void Loop(int sock, int poolSize)
+        {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            prctl(PR_SET_NAME, "zygote");
+
+            // 子进程退出通过signalfd通知
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &mask, nullptr);
+            int sigFd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+            std::vector<Idle> idle;
+            std::unordered_map<pid_t, Busy> busy;
+
+            while (true)
+            {
+                // 补足空闲子进程
+                while ((int)idle.size() < poolSize)
+                {
+                    Idle child;
+                    if (!Prefork(&child))
+                        break;
+                    idle.push_back(child);
+                }
+
+                struct pollfd fds[2] = {{sock, POLLIN, 0}, {sigFd, POLLIN, 0}};
+                if (poll(fds, 2, -1) < 0)
+                {
+                    continue;
+                }
+
+                if (fds[0].revents)
+                {
+                    Request req;
+                    std::vector<int> reqFds;
+                    ssize_t n = RecvFds(sock, &req, sizeof req, &reqFds);
+                    if (0 == n || (n < 0 && errno != EAGAIN))
+                    {
+                        // 服务已退出
+                        break;
+                    }
+                    if (n == sizeof req && reqFds.size() == (size_t)(4 + (req.hasExeFd ? 1 : 0) + (req.hasCgroupFd ? 1 : 0)))
+                    {
+                        Dispatch(req, reqFds, &idle, &busy);
+                    }
+                    else
+                    {
+                        CloseAll(reqFds);
+                    }
+                }
+
+                if (fds[1].revents)
+                {
+                    struct signalfd_siginfo si;
+                    while (read(sigFd, &si, sizeof si) > 0)
+                    {
+                    }
+                    Reap(&idle, &busy);
+                }
+            }
+
+            for (auto &child : idle)
+                close(child.channel);
+        }
+
+        /**
+         * @brief 预先创建一个子进程
+         *
+         */
+        static bool Prefork(Idle *out)
+        {
+            int ch[2];
+            if (0 != socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ch))
+            {
+                return false;
+            }
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                close(ch[0]);
+                close(ch[1]);
+                return false;
+            }
+            if (0 == pid)
+            {
+                ChildMain(ch[1]);
+            }
+            close(ch[1]);
+            out->pid = pid;
+            out->channel = ch[0];
+            return true;
+        }
+
+        /**
+         * @brief 把任务交给空闲子进程
+         * reqFds：stdin, stdout, stderr, 回复socket, [可执行程序], [cgroup.procs]
+         */
+        static void Dispatch(const Request &req, std::vector<int> &reqFds,
+                             std::vector<Idle> *idle, std::unordered_map<pid_t, Busy> *busy)
+        {
+            int replyFd = reqFds[3];
+            std::vector<int> childFds = {reqFds[0], reqFds[1], reqFds[2]};
+            childFds.insert(childFds.end(), reqFds.begin() + 4, reqFds.end());
+
+            while (true)
+            {
+                Idle child;
+                if (!idle->empty())
+                {
+                    child = idle->back();
+                    idle->pop_back();
+                }
+                else if (!Prefork(&child))
+                {
+                    Reply rep = Reply();
+                    rep.pid = -1;
+                    rep.err = EAGAIN;
+                    send(replyFd, &rep, sizeof rep, MSG_NOSIGNAL);
+                    close(replyFd);
+                    break;
+                }
+
+                if (SendFds(child.channel, &req, sizeof req, childFds))
+                {
+                    // 子进程尚未被回收，此时打开的pidfd一定指向它
+                    Reply rep = Reply();
+                    rep.pid = child.pid;
+                    rep.started = 1;
+                    std::vector<int> pidFds;
+                    int pidFd = SysUtil::PidfdOpen(child.pid);
+                    if (pidFd >= 0)
+                        pidFds.push_back(pidFd);
+                    SendFds(replyFd, &rep, sizeof rep, pidFds);
+                    if (pidFd >= 0)
+                        close(pidFd);
+                    (*busy)[child.pid] = Busy{replyFd, child.channel};
+                    break;
+                }
+                // 子进程已异常退出，换一个
+                close(child.channel);
+                kill(child.pid, SIGKILL);
+            }
+            CloseAll(childFds);
+        }
+
+        /**
+         * @brief 回收退出的子进程，并把结果交给服务
+         *
+         */
+        static void Reap(std::vector<Idle> *idle, std::unordered_map<pid_t, Busy> *busy)
+        {
+            int status = 0;
+            struct rusage usage;
+            pid_t pid;
+            while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+            {
+                auto iter = busy->find(pid);
+                if (iter != busy->end())
+                {
+                    Reply rep = {pid, status, 0, 0, usage};
+                    // 程序替换失败时，子进程在退出前写入了errno
+                    int err = 0;
+                    if (recv(iter->second.channel, &err, sizeof err, MSG_DONTWAIT) == sizeof err)
+                        rep.err = err;
+                    send(iter->second.replyFd, &rep, sizeof rep, MSG_NOSIGNAL);
+                    close(iter->second.replyFd);
+                    close(iter->second.channel);
+                    busy->erase(iter);
+                    continue;
+                }
+                for (auto it = idle->begin(); it != idle->end(); ++it)
+                {
+                    if (it->pid == pid)
+                    {
+                        close(it->channel);
+                        idle->erase(it);
+                        break;
+                    }
+                }
+            }
+        }
+
+        /**
+         * @brief 预创建子进程的入口，等待任务并执行
+         *
+         */
+        static void ChildMain(int channel)
+        {
+            // zygote退出时随之退出；只保留与zygote通信的socket，不持有其他任务的fd
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (channel != 3)
+            {
+                dup2(channel, 3);
+                close(channel);
+                channel = 3;
+            }
+            fcntl(channel, F_SETFD, FD_CLOEXEC);
+            CloseFrom(4);
+
+            // 恢复默认的信号处理方式与信号屏蔽字
+            struct sigaction sa;
+            for (int sig = 1; sig < NSIG; sig++)
+            {
+                if (0 == sigaction(sig, nullptr, &sa) && sa.sa_handler != SIG_DFL)
+                {
+                    sa.sa_handler = SIG_DFL;
+                    sa.sa_flags = 0;
+                    sigaction(sig, &sa, nullptr);
+                }
+            }
+            sigset_t empty;
+            sigemptyset(&empty);
+            sigprocmask(SIG_SETMASK, &empty, nullptr);
+
+            Request req;
+            std::vector<int> fds;
+            if (RecvFds(channel, &req, sizeof req, &fds) != sizeof req || fds.size() < 3)
+            {
+                _exit(0);
+            }
+
+            // 重定向
+            for (int i = 0; i < 3; i++)
+            {
+                if (fds[i] == i)
+                    fcntl(i, F_SETFD, 0);
+                else
+                    dup2(fds[i], i);
+            }
+            // 资源约束
+            size_t cgroupIdx = req.hasExeFd ? 4 : 3;
+            if (req.hasCgroupFd && (fds.size() <= cgroupIdx || write(fds[cgroupIdx], "0", 1) != 1))
+            {
+                int err = errno;
+                send(channel, &err, sizeof err, MSG_NOSIGNAL);
+                _exit(127);
+            }
+            if (req.cpuLimit > 0)
+            {
+                struct rlimit cpuR = {req.cpuLimit, RLIM_INFINITY};
+                setrlimit(RLIMIT_CPU, &cpuR);
+            }
+            if (req.memLimit > 0)
+            {
+                struct rlimit memR = {req.memLimit, RLIM_INFINITY};
+                setrlimit(RLIMIT_AS, &memR);
+            }
+
+            char *argv[] = {req.exePath, nullptr};
+            if (req.hasExeFd && fds.size() > 3)
+            {
+                char name[] = "main";
+                argv[0] = name;
+                for (int i = 0; i < 100; i++)
+                {
+                    fexecve(fds[3], argv, environ);
+                    if (errno != ETXTBSY)
+                        break;
+                    usleep(1000);
+                }
+            }
+            else
+            {
+                execv(req.exePath, argv);
+            }
+            int err = errno;
+            send(channel, &err, sizeof err, MSG_NOSIGNAL);
+            _exit(127);
+        }
+    };
+}
@@ -0,0 +1,235 @@
+/*
+* 熔断与重试预算
+* 每台主机一个熔断器：关闭(正常) -> 最近请求的失败比例超过阈值后打开(不再选择) -> 一段时间后半开(只放行一个试探请求)
+* 试探成功则关闭，失败则重新打开；单次读写超时(如用户程序sleep)不会使主机离线
+* 重试预算为全局令牌桶：每个判题请求存入 retryBudgetRatio 个令牌，每次重试取出一个，部分主机故障时重试不会成倍放大负载
+*/
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+namespace ns_breaker
+{
+    const size_t breakerWindowSize = 20;      // 统计失败比例的最近请求数
+    const size_t breakerMinRequests = 10;     // 窗口内请求数不足时不打开
+    const double breakerFailureRatio = 0.5;   // 失败比例达到该值时打开
+    const int breakerOpenMs = 5 * 1000;       // 打开后到允许试探的时间 (ms)
+    const double retryBudgetRatio = 0.2;      // 每个判题请求存入的重试令牌数
+    const double retryBudgetBurst = 10;       // 重试令牌数上限
+
+    enum class BreakerState
+    {
+        Closed,   // 正常
+        Open,     // 熔断中，不被选择
+        HalfOpen, // 只放行一个试探请求
+    };
+
+    class CircuitBreaker
+    {
+    public:
+        CircuitBreaker()
+            : _state(BreakerState::Closed), _openUntilMs(0), _trial(false), _outcomes(breakerWindowSize), _next(0), _count(0), _failures(0)
+        {
+        }
+
+        /**
+         * @brief 选择主机时过滤候选，不加锁、不占用试探名额
+         *
+         */
+        bool Available()
+        {
+            switch (_state.load(std::memory_order_acquire))
+            {
+            case BreakerState::Closed:
+                return true;
+            case BreakerState::Open:
+                return NowMs() >= _openUntilMs.load(std::memory_order_relaxed);
+            default:
+                return !_trial.load(std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * @brief 向主机发出请求前调用，半开时占用唯一的试探名额
+         * return：为假时不能向该主机发出请求
+         */
+        bool Acquire()
+        {
+            if (_state.load(std::memory_order_acquire) == BreakerState::Closed)
+            {
+                return true;
+            }
+            std::lock_guard<std::mutex> lock(_mtx);
+            BreakerState state = _state.load(std::memory_order_relaxed);
+            if (state == BreakerState::Closed)
+            {
+                return true;
+            }
+            if (state == BreakerState::Open)
+            {
+                if (NowMs() < _openUntilMs.load(std::memory_order_relaxed))
+                {
+                    return false;
+                }
+                _state.store(BreakerState::HalfOpen, std::memory_order_release);
+            }
+            else if (_trial.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+            _trial.store(true, std::memory_order_relaxed);
+            return true;
+        }
+
+        /**
+         * @brief 记录请求结果
+         * return：本次结果使熔断器打开时为真
+         */
+        bool OnResult(bool success)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            switch (_state.load(std::memory_order_relaxed))
+            {
+            case BreakerState::HalfOpen:
+                if (!_trial.load(std::memory_order_relaxed))
+                {
+                    // 打开之前发出的请求，不代表试探结果
+                    return false;
+                }
+                _trial.store(false, std::memory_order_relaxed);
+                if (success)
+                {
+                    ClearWindow();
+                    _state.store(BreakerState::Closed, std::memory_order_release);
+                    return false;
+                }
+                Trip();
+                return true;
+            case BreakerState::Open:
+                return false;
+            default:
+                break;
+            }
+
+            if (_count == _outcomes.size())
+            {
+                _failures -= _outcomes[_next] ? 0 : 1;
+            }
+            else
+            {
+                ++_count;
+            }
+            _outcomes[_next] = success;
+            _failures += success ? 0 : 1;
+            _next = (_next + 1) % _outcomes.size();
+            if (_count >= breakerMinRequests && _failures >= breakerFailureRatio * _count)
+            {
+                Trip();
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief 请求被取消或被拒绝(503)，不计入结果，释放试探名额
+         *
+         */
+        void OnCancel()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_state.load(std::memory_order_relaxed) == BreakerState::HalfOpen)
+            {
+                _trial.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * @brief 恢复为关闭状态，主机重新上线时调用
+         *
+         */
+        void Reset()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            ClearWindow();
+            _trial.store(false, std::memory_order_relaxed);
+            _state.store(BreakerState::Closed, std::memory_order_release);
+        }
+
+        BreakerState GetState()
+        {
+            return _state.load(std::memory_order_acquire);
+        }
+
+    private:
+        // 以下调用者持有_mtx
+        void Trip()
+        {
+            ClearWindow();
+            _openUntilMs.store(NowMs() + breakerOpenMs, std::memory_order_relaxed);
+            _state.store(BreakerState::Open, std::memory_order_release);
+        }
+        void ClearWindow()
+        {
+            _next = 0;
+            _count = 0;
+            _failures = 0;
+        }
+
+        static int64_t NowMs()
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    private:
+        std::atomic<BreakerState> _state;
+        std::atomic<int64_t> _openUntilMs; // 打开状态的结束时间 (ms)
+        std::atomic<bool> _trial;          // 半开状态下试探请求是否已发出
+        std::mutex _mtx;                   // 串行化状态转换与窗口更新，关闭状态下的Acquire不加锁
+        std::vector<bool> _outcomes;       // 最近请求的结果，环形缓冲区
+        size_t _next;
+        size_t _count;
+        size_t _failures;
+    };
+
+    // 全局重试预算，令牌桶
+    class RetryBudget
+    {
+    public:
+        RetryBudget() : _tokens(retryBudgetBurst) {}
+
+        /**
+         * @brief 每个判题请求开始时存入令牌
+         *
+         */
+        void Deposit()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _tokens = std::min(retryBudgetBurst, _tokens + retryBudgetRatio);
+        }
+
+        /**
+         * @brief 申请一次重试
+         * return：令牌不足时为假
+         */
+        bool TryWithdraw()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_tokens < 1)
+            {
+                return false;
+            }
+            _tokens -= 1;
+            return true;
+        }
+
+    private:
+        double _tokens;
+        std::mutex _mtx;
+    };
+}
@@ -6,12 +6,18 @@
 #include <algorithm>
 #include <jsoncpp/json/json.h>
 #include <mutex>
+#include <chrono>
+#include <atomic>
+#include <thread>
 #include <assert.h>
 // #include <pthread.h>
 
 #include "./oj_model_mysql.hpp"
 // #include "./oj_model_file.hpp"
 #include "./oj_view.hpp"
+#include "./oj_load_blance.hpp"
+#include "./oj_hedge.hpp"
+#include "./oj_dispatch.hpp"
 #include "../comm/log.hpp"
 #include "../comm/util.hpp"
 #include "../comm/httplib.h"
@@ -23,6 +29,9 @@ namespace ns_control
     using namespace ns_util;
     using namespace ns_model;
     using namespace ns_view;
+    using namespace ns_load_blance;
+    using namespace ns_hedge;
+    using namespace ns_dispatch;
 
     enum class Error
     {
@@ -42,286 +51,115 @@ namespace ns_control
     };
 
     const std::string banCodePath = "questions/banCode.cpp";
-    const std::string serviceMachinePath = "conf/service_machine.conf"; // oj_server/conf/service_machine.conf
-    class Machine                                                       // 主机
+    const useconds_t judgeBusyBackoffUs = 20 * 1000; // 编译服务返回503后，重新选择主机前的等待时间
+    const int judgeBusyMaxRetries = 50;              // 503后重试的最多次数，不消耗重试预算
+    const int judgeFailedStatus = -8;                // 判题服务放弃请求时返回给用户的状态码
+    const long judgePollWaitMs = 5 * 1000;           // 单次长轮询的最长等待时间 (ms)
+    const int jobCancelTimeoutMs = 300;              // 取消任务请求的连接/读超时 (ms)
+
+    class Control
     {
     public:
-        Machine()
-            : _ip(""), _port(0), _load(0), _mtx(nullptr)
+        Control() : _dispatchMode(DispatchMode::Push)
         {
+            assert(FileUtil::ReadFile(banCodePath, &_banCode, true));
         }
-        ~Machine() {}
-        void SetPort(int port)
-        {
-            _port = port;
-        }
-        int GetPort()
-        {
-            return _port;
-        }
-        void SetIp(const std::string &ip)
-        {
-            _ip = ip;
-        }
-        std::string GetIp()
-        {
-            return _ip;
-        }
-        void SetLoad(uint64_t load)
-        {
-            _load = load;
-        }
-        uint64_t GetLoad()
-        {
-            uint64_t load = 0;
-            if (_mtx)
-                _mtx->lock();
-
-            load = _load;
-
-            if (_mtx)
-                _mtx->unlock();
-
-            return load;
-        }
-        void SetMutex(std::mutex *mtx)
-        {
-            _mtx = mtx;
-        }
-
-        /**
-         * @brief 增加主机负载
-         * 
-         */
-        void IncLoad()
-        {
-            if (_mtx)
-                _mtx->lock();
-
-            ++_load;
-
-            if (_mtx)
-                _mtx->unlock();
-        }
-
-        /**
-         * @brief 减少主机负载
-         * 
-         */
-        void DecLoad()
-        {
-            if (_mtx)
-                _mtx->lock();
-
-            --_load;
+        ~Control() {}
 
-            if (_mtx)
-                _mtx->unlock();
-        }
         /**
-         * @brief 重置主机负载情况
-         * 
+         * @brief 设置对冲请求，服务启动时、处理请求之前调用
+         *
          */
-        void ResetLoad()
+        void SetHedge(const HedgeOptions &opt)
         {
-            if (_mtx)
-                _mtx->lock();
-
-            _load = 0;
-
-            if (_mtx)
-                _mtx->unlock();
-        }
-
-    private:
-        std::string _ip;
-        int _port;
-        uint64_t _load;
-        std::mutex *_mtx;
-    };
-
-    class LoadBlance // 负载均衡
-    {
-    public:
-        LoadBlance()
-        {
-            assert(LoadConf(serviceMachinePath));
+            _hedge = opt;
+            _hedgeBudget.SetRatio(opt.budgetRatio);
+            if (_hedge.enabled)
+            {
+                LOG(INFO) << "对冲请求已开启，等待时间：近期延迟的p" << opt.percentile << "，预算：" << opt.budgetRatio << std::endl;
+            }
         }
-        ~LoadBlance() {}
 
         /**
-         * @brief 加载所有主机
-         * serviceMachineConf: 主机配置信息文件路径
+         * @brief 构建题目列表html
+         * html：输出型参数
          */
-        bool LoadConf(const std::string &serviceMachineConf)
+        bool AllQuestionsHtml(std::string *html)
         {
-            std::ifstream in(serviceMachineConf);
-            if (!in.is_open())
+            std::vector<struct Question> allQues;
+            if (!_model.GetAllQuestions(&allQues))
             {
-                LOG(FATAL) << "主机配置文件加载失败\n";
+                LOG(ERROR) << "获取题库失败\n";
+                *html = "获取题目列表失败，请刷新！";
                 return false;
             }
-            std::string line;
-            while (getline(in, line))
-            {
-                std::vector<std::string> strs;
-                StringUtil::SplitString(line, &strs, ":");
-                if (2 != strs.size())
-                {
-                    LOG(WARING) << "主机信息错误：" << line << std::endl;
-                    continue;
-                }
-
-                Machine m;
-                m.SetIp(strs[0]);
-                m.SetPort(atoi(strs[1].c_str()));
-                m.SetLoad(0);
-                m.SetMutex(new std::mutex());
 
-                _online.push_back(_machines.size());
-                _machines.push_back(m);
-            }
+            std::sort(allQues.begin(), allQues.end(), [](const struct Question &q1, const struct Question &q2)
+                      { return std::atoi(q1.number.c_str()) < std::atoi(q2.number.c_str()); });
+            _view.AllQuestionsExpandHtml(allQues, html);
 
-            in.close();
-            LOG(INFO) << "主机配置文件加载成功\n";
             return true;
         }
 
         /**
-         * @brief 选择负载最低的主机提供编译运行服务 
-         * *id： 选择的主机的id
-         * *m：选择的主机的对象的地址
-         * return：真为成功
-         * 
-         * 1. 随机数+hash
-         * 2. 轮询+hash
+         * @brief 设置分发判题任务的方式，服务启动时、处理请求之前调用
+         *
          */
-        bool SmartChoice(int *id, Machine **m)
+        void SetDispatchMode(DispatchMode mode)
         {
-            _mtx.lock();
-
-            int onlineNum = _online.size();
-            if (0 == onlineNum) // 无在线主机
+            _dispatchMode = mode;
+            if (mode == DispatchMode::Pull)
             {
-                _mtx.unlock();
-                LOG(FATAL) << "所有主机全部离线，请注意，请注意！\n";
-                return false;
+                LOG(INFO) << "拉取模式已开启，编译服务从 /judge_tasks 领取判题任务\n";
             }
-
-            // 轮询查找负载最小的机器
-            uint64_t minLoad = _machines[_online[0]].GetLoad();
-            *id = _online[0];
-            *m = &_machines[_online[0]];
-            for (int i = 1; i < onlineNum; i++)
-            {
-                uint64_t currLoad = _machines[_online[i]].GetLoad();
-                if (minLoad > currLoad)
-                {
-                    minLoad = currLoad;
-                    *id = _online[i];
-                    *m = &_machines[_online[i]];
-                }
-            }
-
-            _mtx.unlock();
-
-            return true;
         }
 
         /**
-         * @brief 离线指定主机
-         * 
+         * @brief 拉取模式：编译服务领取判题任务
+         * waitMs：没有任务时最多等待的时间
+         * taskJson：输出参数，{"lease": 租约号, "request": compileJson}
+         * return：等待超时时为假
          */
-        void OfflineMachine(int machineId)
+        bool FetchJudgeTask(int waitMs, std::string *taskJson)
         {
-            _mtx.lock();
-
-            for (auto iter = _online.begin(); iter != _online.end(); iter++)
+            std::string lease, request;
+            if (!_judgeQueue.Fetch(waitMs, &lease, &request))
             {
-                if (*iter == machineId)
-                {
-                    _machines[machineId].ResetLoad();
-                    _online.erase(iter);
-                    _offline.push_back(machineId);
-                    break; // erase之后，迭代器不再++，无迭代器失效问题
-                }
+                return false;
             }
-
-            _mtx.unlock();
+            Json::Value taskVal;
+            taskVal["lease"] = lease;
+            taskVal["request"] = request;
+            Json::FastWriter writer;
+            *taskJson = writer.write(taskVal);
+            return true;
         }
 
         /**
-         * @brief 上线指定主机
-         * 当所有主机离线时，上线所有主机
+         * @brief 拉取模式：编译服务提交判题结果
+         * lease：领取时发放的租约号
+         * return：租约号不存在(任务已放弃)或任务已完成时为假
          */
-        void OnlineMachine()
+        bool CompleteJudgeTask(const std::string &lease, const std::string &outJson)
         {
-            _mtx.lock();
-
-            _online.insert(_online.end(), _offline.begin(), _offline.end());
-            _offline.erase(_offline.begin(), _offline.end());
-
-            _mtx.unlock();
-
-            LOG(INFO) << "重新上线所有主机!\n";
+            return _judgeQueue.Complete(lease, outJson);
         }
 
         /**
-         * @brief 显示在线主机，for test
-         * 
+         * @brief 设置选择编译服务主机的方式，服务启动时、处理请求之前调用
+         *
          */
-        void ShowMachines()
+        void SetRouteMode(RouteMode mode)
         {
-            _mtx.lock();
-            std::cout << "在线主机列表：";
-            for (auto &id : _online)
+            _loadBlance.SetRouteMode(mode);
+            if (mode == RouteMode::Affinity)
             {
-                std::cout << id << " ";
+                LOG(INFO) << "按题号亲和路由已开启\n";
             }
-            std::cout << "\n离线主机列表：";
-            for (auto &id : _offline)
-            {
-                std::cout << id << " ";
-            }
-            std::cout << std::endl;
-            _mtx.unlock();
-        }
-
-    private:
-        std::vector<Machine> _machines; // 下标即代表主机id
-        std::vector<int> _online;       // 在线主机ID
-        std::vector<int> _offline;      // 离线主机ID
-        std::mutex _mtx;
-    };
-
-    class Control
-    {
-    public:
-        Control()
-        {
-            assert(FileUtil::ReadFile(banCodePath, &_banCode, true));
-        }
-        ~Control() {}
-
-        /**
-         * @brief 构建题目列表html
-         * html：输出型参数
-         */
-        bool AllQuestionsHtml(std::string *html)
-        {
-            std::vector<struct Question> allQues;
-            if (!_model.GetAllQuestions(&allQues))
+            else if (mode == RouteMode::BinPack)
             {
-                LOG(ERROR) << "获取题库失败\n";
-                *html = "获取题目列表失败，请刷新！";
-                return false;
+                LOG(INFO) << "按内存与CPU槽位装箱已开启\n";
             }
-
-            std::sort(allQues.begin(), allQues.end(), [](const struct Question &q1, const struct Question &q2)
-                      { return std::atoi(q1.number.c_str()) < std::atoi(q2.number.c_str()); });
-            _view.AllQuestionsExpandHtml(allQues, html);
-
-            return true;
         }
 
         /**
@@ -364,10 +202,15 @@ namespace ns_control
          *      code：用户提供的代码
          *      input：用户自测样例(不处理)
          * 输出/outJson结构:
-         *      status：状态码
-         *      reason：状态码描述
+         *      code：状态码
+         *      reason：状态码描述，没有主机可用或放弃重试时code为judgeFailedStatus
          *      stdout：程序运行完成的-*结果(选填)
          *      stderr：程序运行失败的错误结果
+         *      outputTruncated：程序输出超出上限被截断(选填)
+         *      tests/testsPassed/testsTotal：数据驱动题目每组用例的结果(选填)，stdout由此生成
+         *      compileMs/cpuMs/wallMs/peakRssKB/outputBytes：编译耗时与程序的资源使用(选填)，见编译服务的CompileAndRun::Finish
+         *      machine：判题主机(推送模式)
+         *      judgeMs：从提交到得到结果的耗时 (ms，推送模式)
          */
         void Judge(const std::string &number, const std::string &inJson, std::string *outJson)
         {
@@ -385,42 +228,135 @@ namespace ns_control
             {
                 compileVal["code"] = _banCode + inVal["code"].asString() + ques.tail;
             }
+            // 测试框架由编译服务按题号单独编译、缓存，再与代码链接
+            if (!ques.harness.empty())
+            {
+                compileVal["number"] = ques.number;
+                compileVal["harness"] = ques.harness;
+            }
+            // 测试数据由编译服务按 题号+版本 缓存，逐组作为程序的输入运行并比对输出
+            // 只发送版本，编译服务未缓存时(code为-9)再附带数据重新提交
+            if (ques.tests)
+            {
+                compileVal["number"] = ques.number;
+                compileVal["testsVersion"] = ques.tests->version;
+            }
             compileVal["cpuLimit"] = ques.cpuLimit;
             compileVal["memLimit"] = ques.memLimit;
             Json::FastWriter writer;
             std::string compileJson = writer.write(compileVal);
+            // 等待编译服务的时间：每次运行不超过cpuLimit*2，留出余量为cpuLimit*3，数据驱动的题目每组用例各运行一次
+            int judgeTimeoutSec = ques.cpuLimit * 3 * std::max<int>(1, ques.tests ? ques.tests->cases.size() : 0);
+            // 拉取模式：放入中心队列，由空闲的编译服务领取
+            if (_dispatchMode == DispatchMode::Pull)
+            {
+                bool ok = _judgeQueue.Submit(compileJson, judgeTimeoutSec, outJson);
+                if (ok && ques.tests && NeedTests(*outJson))
+                {
+                    LOG(INFO) << "编译服务未缓存测试数据，附带数据重新提交，题目：" << number << std::endl;
+                    AttachTests(*ques.tests, &compileVal);
+                    ok = _judgeQueue.Submit(writer.write(compileVal), judgeTimeoutSec, outJson);
+                }
+                if (!ok)
+                {
+                    LOG(ERROR) << "拉取模式判题失败，题目：" << number << std::endl;
+                    RenderFailure("判题超时，请稍后重试", outJson);
+                    return;
+                }
+                RenderTests(outJson);
+                return;
+            }
             // 3. 负载均衡
-            // 一直选择，直到主机可用且功能正常，否则代表全部挂掉
-            while (true)
+            // 一直选择，直到主机可用且功能正常，否则代表全部挂掉或熔断
+            // 第一次请求之后，失败后的重试消耗全局重试预算，预算耗尽时放弃
+            // 503代表编译服务正常但队列已满，退避后重试不消耗预算，只限制次数
+            // 编译服务未缓存测试数据时附带数据重新提交，同样不消耗预算
+            _retryBudget.Deposit();
+            bool judged = false;
+            bool busy = false;
+            bool resend = false;
+            int busyRetries = 0;
+            std::string failReason = "没有可用的判题主机，请稍后重试";
+            for (int attempt = 0;; attempt++)
             {
                 int id = 0;
                 Machine *m = nullptr;
 
-                if (!_loadBlance.SmartChoice(&id, &m))
+                if (busy)
+                {
+                    if (++busyRetries > judgeBusyMaxRetries)
+                    {
+                        LOG(WARNING) << "判题主机持续繁忙，放弃本次判题，已尝试：" << attempt << "次\n";
+                        failReason = "判题主机繁忙，请稍后重试";
+                        break;
+                    }
+                }
+                else if (attempt > 0 && !resend && !_retryBudget.TryWithdraw())
+                {
+                    LOG(WARNING) << "重试预算已耗尽，放弃本次判题，已尝试：" << attempt << "次\n";
+                    failReason = "判题服务繁忙，请稍后重试";
+                    break;
+                }
+                busy = false;
+                resend = false;
+                if (!_loadBlance.Choice(number, ques.memLimit, &id, &m))
                 {
                     break;
                 }
                 LOG(INFO) << "主机选择成功，主机：" << id << ":" << m->GetIp() << ":" << m->GetPort() << "，负载：" << m->GetLoad() << std::endl;
                 // 4. http请求
                 httplib::Client cli(m->GetIp(), m->GetPort());
-                // 设置IO的最大等待时间
-                cli.set_read_timeout(ques.cpuLimit * 3, 0);
-                cli.set_write_timeout(ques.cpuLimit * 3, 0);
-                // 编译服务只需要一次http，关闭长连接
-                cli.set_keep_alive(false);
-                m->IncLoad();
-                auto res = cli.Post("/compile_and_run", compileJson, "application/json");
+                // 设置IO的最大等待时间，单次长轮询不超过judgeTimeoutSec，额外留1s
+                cli.set_read_timeout(judgeTimeoutSec + 1, 0);
+                cli.set_write_timeout(judgeTimeoutSec, 0);
+                // 提交与轮询复用同一连接
+                cli.set_keep_alive(true);
+                m->IncLoad(ques.memLimit);
+                auto start = std::chrono::steady_clock::now();
+                // 对冲请求胜出时，id、m、start改为对冲请求所在的主机与开始时间
+                auto res = _hedge.enabled ? SubmitHedged(cli, &id, &m, compileJson, judgeTimeoutSec, ques.memLimit, &start)
+                                          : SubmitAndWait(cli, compileJson, judgeTimeoutSec);
+                double latencyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
                 if (res)
                 {
                     // 5. 返回结果
+                    if (res->status == 200 && ques.tests && !compileVal.isMember("tests") && NeedTests(res->body))
+                    {
+                        LOG(INFO) << "主机未缓存测试数据，附带数据重新提交，题目：" << number << std::endl;
+                        m->DecLoad(ques.memLimit);
+                        // 不是失败，不计入熔断器，但要释放半开时占用的试探名额
+                        m->RecordCancel();
+                        AttachTests(*ques.tests, &compileVal);
+                        compileJson = writer.write(compileVal);
+                        resend = true;
+                        continue;
+                    }
                     if (res->status == 200)
                     {
-                        *outJson = res->body;
-                        m->DecLoad();
+                        *outJson = AnnotateResult(number, res->body, m, latencyMs);
+                        m->DecLoad(ques.memLimit);
+                        m->RecordResult(latencyMs, true);
+                        if (_hedge.enabled)
+                        {
+                            _latency.Record(latencyMs);
+                        }
                         LOG(INFO) << "请求编译运行服务成功\n";
+                        judged = true;
                         break;
                     }
-                    m->DecLoad();
+                    m->DecLoad(ques.memLimit);
+                    // 503：编译服务的队列已满，稍后再选择主机，避免空转
+                    if (res->status == 503)
+                    {
+                        LOG(WARNING) << "主机繁忙，主机ID：" << id << "，主机：" << m->GetIp() << ":" << m->GetPort() << std::endl;
+                        m->RecordCancel();
+                        busy = true;
+                        usleep(judgeBusyBackoffUs);
+                    }
+                    else
+                    {
+                        m->RecordResult(latencyMs, false);
+                    }
                 }
                 else if (res.error() == httplib::Error::Read || res.error() == httplib::Error::Write)
                 {
@@ -430,18 +366,27 @@ namespace ns_control
                     // 而此时编译服务还在执行程序，就会发生<<如错>>
                     // 所以需要约定，网络IO的最大时间为cpuLinmit*3，而程序的存在时间为cpuLimit*2
                     // 保证，在IO超时的前一刻，将用户的程序结束
+                    // 因此读写出错不直接离线主机，只计入熔断器，失败比例超过阈值时才暂停选择该主机
 
-                    LOG(ERROR) << "当前主机已离线，主机ID：" << id << "，主机：" << m->GetIp() << ":" << m->GetPort() << std::endl;
-                    _loadBlance.OfflineMachine(id);
-                    _loadBlance.ShowMachines();
+                    m->DecLoad(ques.memLimit);
+                    m->RecordResult(latencyMs, false);
+                    LOG(WARNING) << "请求主机超时，主机ID：" << id << "，主机：" << m->GetIp() << ":" << m->GetPort() << std::endl;
                 }
                 else
                 {
+                    m->DecLoad(ques.memLimit);
+                    m->RecordResult(latencyMs, false);
                     LOG(ERROR) << "当前主机已离线，主机ID：" << id << "，主机：" << m->GetIp() << ":" << m->GetPort() << std::endl;
                     _loadBlance.OfflineMachine(id);
                     _loadBlance.ShowMachines();
                 }
             }
+            if (!judged)
+            {
+                RenderFailure(failReason, outJson);
+                return;
+            }
+            RenderTests(outJson);
         }
 
         /**
@@ -453,10 +398,336 @@ namespace ns_control
             _loadBlance.OnlineMachine();
         }
 
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        /**
+         * @brief 编译服务未缓存该版本的测试数据时为真(code为-9)
+         *
+         */
+        static bool NeedTests(const std::string &outJson)
+        {
+            Json::Value outVal;
+            Json::Reader reader;
+            return reader.parse(outJson, outVal) && outVal["code"].asInt() == -9;
+        }
+
+        /**
+         * @brief 在编译请求中附带全部测试数据
+         *
+         */
+        static void AttachTests(const TestData &tests, Json::Value *compileVal)
+        {
+            Json::Value &items = (*compileVal)["tests"];
+            for (const auto &tc : tests.cases)
+            {
+                Json::Value item;
+                item["input"] = tc.input;
+                item["output"] = tc.output;
+                items.append(item);
+            }
+        }
+
+        /**
+         * @brief 放弃判题时生成与编译服务相同结构的结果，避免返回空结果
+         *
+         */
+        static void RenderFailure(const std::string &reason, std::string *outJson)
+        {
+            Json::Value outVal;
+            outVal["code"] = judgeFailedStatus;
+            outVal["reason"] = reason;
+            Json::FastWriter writer;
+            *outJson = writer.write(outVal);
+        }
+
+        /**
+         * @brief 数据驱动的题目没有测试框架的输出，按每组用例的结果生成stdout，与测试框架的格式一致
+         *
+         */
+        static void RenderTests(std::string *outJson)
+        {
+            Json::Value outVal;
+            Json::Reader reader;
+            if (!reader.parse(*outJson, outVal) || !outVal["tests"].isArray())
+            {
+                return;
+            }
+            std::string html;
+            int idx = 0;
+            for (const auto &tc : outVal["tests"])
+            {
+                ++idx;
+                html += "用例" + std::to_string(idx);
+                html += tc["passed"].asBool() ? "<span style = \"color:#2DB55D\">通过</span>" : "<span style = \"color:#EF4743\">未通过</span>";
+                if (tc.isMember("reason"))
+                {
+                    html += "，" + tc["reason"].asString();
+                }
+                html += "<br>\n";
+            }
+            outVal["stdout"] = html;
+            Json::FastWriter writer;
+            *outJson = writer.write(outVal);
+        }
+
+        /**
+         * @brief 在编译服务的结果中附上判题主机与耗时，并记录程序的资源使用
+         * 按题目统计可用于调整时空限制，按主机统计可用于发现慢主机
+         */
+        std::string AnnotateResult(const std::string &number, const std::string &body, Machine *m, double latencyMs)
+        {
+            Json::Value outVal;
+            Json::Reader reader;
+            if (!reader.parse(body, outVal) || !outVal.isObject())
+            {
+                return body;
+            }
+            std::string machine = m->GetIp() + ":" + std::to_string(m->GetPort());
+            outVal["machine"] = machine;
+            outVal["judgeMs"] = (Json::Int64)latencyMs;
+            if (outVal.isMember("cpuMs"))
+            {
+                LOG(INFO) << "判题资源使用，题目：" << number << "，主机：" << machine
+                          << "，编译：" << outVal["compileMs"].asInt64() << "ms，CPU：" << outVal["cpuMs"].asInt64()
+                          << "ms，墙钟：" << outVal["wallMs"].asInt64() << "ms，内存峰值：" << outVal["peakRssKB"].asInt64()
+                          << "KB，往返：" << (long)latencyMs << "ms" << std::endl;
+            }
+            Json::FastWriter writer;
+            return writer.write(outVal);
+        }
+
+        /**
+         * @brief 异步提交编译运行任务，再长轮询结果
+         * timeoutSec：从提交到得到结果的最长时间，超时按读超时处理
+         * return：成功时status为200，body为outJson；提交失败、任务丢失(404)时为对应的响应
+         *
+         * 编译服务立即返回任务id，不再让一次http连接等待整个编译运行过程
+         */
+        httplib::Result SubmitAndWait(httplib::Client &cli, const std::string &compileJson, int timeoutSec)
+        {
+            std::string jobPath;
+            auto res = PostJob(cli, compileJson, &jobPath);
+            if (!res || res->status != 202)
+            {
+                return res;
+            }
+            httplib::Result out(nullptr, httplib::Error::Read);
+            PollJob(cli, jobPath, Clock::now() + std::chrono::seconds(timeoutSec), judgePollWaitMs, nullptr, &out);
+            return out;
+        }
+
+        /**
+         * @brief 提交任务，可能对冲到第二台主机
+         * id/m/start：主请求的主机与开始时间，对冲请求胜出时改为对冲请求的
+         * memKB：为对冲请求在第二台主机上预留的内存
+         * return：同 SubmitAndWait，为胜出一方的结果
+         *
+         * 主请求超过近期延迟的分位数仍未完成、且预算允许时，选择另一台主机提交同一任务
+         * 两路同时轮询，先得到200的一路胜出，另一路断开连接并取消编译服务上的任务
+         * 一路失败时继续等待另一路，都失败时返回主请求的结果，由调用者按原方式处理
+         */
+        httplib::Result SubmitHedged(httplib::Client &cli, int *id, Machine **m, const std::string &compileJson, int timeoutSec,
+                                     int memKB, Clock::time_point *start)
+        {
+            _hedgeBudget.BeginPrimary();
+            auto res = HedgedWait(cli, id, m, compileJson, timeoutSec, memKB, start);
+            _hedgeBudget.EndPrimary();
+            return res;
+        }
+
+        httplib::Result HedgedWait(httplib::Client &cli, int *id, Machine **m, const std::string &compileJson, int timeoutSec,
+                                   int memKB, Clock::time_point *start)
+        {
+            std::string jobPath;
+            auto res = PostJob(cli, compileJson, &jobPath);
+            if (!res || res->status != 202)
+            {
+                return res;
+            }
+            Clock::time_point deadline = *start + std::chrono::seconds(timeoutSec);
+            httplib::Result out(nullptr, httplib::Error::Read);
+
+            // 1. 等待到对冲时间，样本不足时不对冲
+            double delayMs = 0;
+            if (!_latency.Percentile(_hedge.percentile, &delayMs))
+            {
+                PollJob(cli, jobPath, deadline, judgePollWaitMs, nullptr, &out);
+                return out;
+            }
+            auto hedgeAt = std::min(deadline, *start + std::chrono::microseconds((long)(std::max(delayMs, hedgeMinDelayMs) * 1000)));
+            if (PollJob(cli, jobPath, hedgeAt, judgePollWaitMs, nullptr, &out) || Clock::now() >= deadline)
+            {
+                return out;
+            }
+
+            // 2. 预算允许时选择另一台主机提交
+            int hedgeId = 0;
+            Machine *hedgeM = nullptr;
+            if (!_hedgeBudget.TryAcquire())
+            {
+                PollJob(cli, jobPath, deadline, judgePollWaitMs, nullptr, &out);
+                return out;
+            }
+            if (!_loadBlance.SmartChoice(&hedgeId, &hedgeM, *id))
+            {
+                _hedgeBudget.Release();
+                PollJob(cli, jobPath, deadline, judgePollWaitMs, nullptr, &out);
+                return out;
+            }
+            long remainSec = std::chrono::duration_cast<std::chrono::seconds>(deadline - Clock::now()).count() + 1;
+            httplib::Client hedgeCli(hedgeM->GetIp(), hedgeM->GetPort());
+            hedgeCli.set_read_timeout(remainSec, 0);
+            hedgeCli.set_write_timeout(remainSec, 0);
+            hedgeCli.set_keep_alive(true);
+            hedgeM->IncLoad(memKB);
+            Clock::time_point hedgeStart = Clock::now();
+            std::string hedgePath;
+            auto hedgeRes = PostJob(hedgeCli, compileJson, &hedgePath);
+            if (!hedgeRes || hedgeRes->status != 202)
+            {
+                hedgeM->DecLoad(memKB);
+                hedgeM->RecordCancel();
+                _hedgeBudget.Release();
+                PollJob(cli, jobPath, deadline, judgePollWaitMs, nullptr, &out);
+                return out;
+            }
+            LOG(INFO) << "发起对冲请求，主机ID：" << *id << " -> " << hedgeId << "，已等待："
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(hedgeStart - *start).count() << "ms" << std::endl;
+
+            // 3. 两路同时轮询，一路得到200后断开另一路的连接
+            std::atomic<bool> primaryCancelled(false);
+            std::atomic<bool> hedgeCancelled(false);
+            httplib::Result hedgeOut(nullptr, httplib::Error::Read);
+            bool hedgeDone = false;
+            std::thread hedgeThread([&]
+                                    {
+                                        hedgeDone = PollJob(hedgeCli, hedgePath, deadline, hedgePollWaitMs, &hedgeCancelled, &hedgeOut);
+                                        if (hedgeDone && hedgeOut && hedgeOut->status == 200)
+                                        {
+                                            primaryCancelled = true;
+                                            cli.stop();
+                                        }
+                                    });
+            bool primaryDone = PollJob(cli, jobPath, deadline, hedgePollWaitMs, &primaryCancelled, &out);
+            if (primaryDone && out && out->status == 200)
+            {
+                hedgeCancelled = true;
+                hedgeCli.stop();
+            }
+            hedgeThread.join();
+
+            // 4. 取消失败的一方
+            bool primaryWon = primaryDone && out && out->status == 200;
+            bool hedgeWon = !primaryWon && hedgeDone && hedgeOut && hedgeOut->status == 200;
+            if (hedgeWon)
+            {
+                LOG(INFO) << "对冲请求胜出，主机ID：" << hedgeId << std::endl;
+                if (!primaryDone)
+                {
+                    CancelJob(*m, jobPath);
+                    (*m)->RecordCancel();
+                }
+                else
+                {
+                    // 主请求自身失败，计入所在主机的错误率与熔断器
+                    (*m)->RecordResult(std::chrono::duration<double, std::milli>(Clock::now() - *start).count(), false);
+                }
+                (*m)->DecLoad(memKB);
+                *id = hedgeId;
+                *m = hedgeM;
+                *start = hedgeStart;
+                out = std::move(hedgeOut);
+            }
+            else
+            {
+                if (primaryWon)
+                {
+                    CancelJob(hedgeM, hedgePath);
+                    hedgeM->RecordCancel();
+                }
+                else
+                {
+                    // 对冲请求自身失败或超时，计入所在主机的错误率与熔断器
+                    hedgeM->RecordResult(std::chrono::duration<double, std::milli>(Clock::now() - hedgeStart).count(), false);
+                }
+                hedgeM->DecLoad(memKB);
+            }
+            _hedgeBudget.Release();
+            return out;
+        }
+
+        /**
+         * @brief 提交任务
+         * jobPath：输出参数，成功(202)时为 /jobs/{id}
+         *
+         */
+        httplib::Result PostJob(httplib::Client &cli, const std::string &compileJson, std::string *jobPath)
+        {
+            auto res = cli.Post("/jobs", compileJson, "application/json");
+            if (res && res->status == 202)
+            {
+                Json::Reader reader;
+                Json::Value idVal;
+                reader.parse(res->body, idVal);
+                *jobPath = "/jobs/" + idVal["id"].asString();
+            }
+            return res;
+        }
+
+        /**
+         * @brief 长轮询任务结果，直到得到最终响应、超过until或被取消
+         * waitMs：单次长轮询的最长等待时间
+         * cancelled：取消标记(选填)，置位后不再发起轮询
+         * out：得到最终响应(非202)或请求出错时为该结果
+         * return：得到最终响应或请求出错时为真
+         */
+        bool PollJob(httplib::Client &cli, const std::string &jobPath, Clock::time_point until, long waitMs,
+                     const std::atomic<bool> *cancelled, httplib::Result *out)
+        {
+            while (!(cancelled && *cancelled))
+            {
+                long remainMs = std::chrono::duration_cast<std::chrono::milliseconds>(until - Clock::now()).count();
+                if (remainMs <= 0)
+                {
+                    return false;
+                }
+                auto res = cli.Get((jobPath + "?wait=" + std::to_string(std::min(remainMs, waitMs))).c_str());
+                if (cancelled && *cancelled)
+                {
+                    return false;
+                }
+                if (!res || res->status != 202)
+                {
+                    *out = std::move(res);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @brief 取消编译服务上的任务，尽力而为，失败时任务按原方式完成后过期
+         *
+         */
+        void CancelJob(Machine *m, const std::string &jobPath)
+        {
+            httplib::Client cli(m->GetIp(), m->GetPort());
+            cli.set_connection_timeout(0, jobCancelTimeoutMs * 1000);
+            cli.set_read_timeout(0, jobCancelTimeoutMs * 1000);
+            cli.Delete(jobPath.c_str());
+        }
+
     private:
         Model _model;
         View _view;
         LoadBlance _loadBlance;
         std::string _banCode;
+        HedgeOptions _hedge;
+        LatencyWindow _latency;   // 最近成功判题请求的延迟，对冲开启时记录
+        HedgeBudget _hedgeBudget; // 对冲预算
+        RetryBudget _retryBudget; // 判题请求的重试预算
+        DispatchMode _dispatchMode;
+        JudgeQueue _judgeQueue;   // 拉取模式的中心任务队列
     };
 }
\ No newline at end of file
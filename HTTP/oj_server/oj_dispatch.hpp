@@ -0,0 +1,226 @@
+/*
+* 拉取模式的判题任务队列
+* 判题线程把任务放入中心队列后等待结果，编译服务在有空闲时长轮询领取任务，完成后提交结果
+* 快的编译服务领取得多，任务不会在繁忙的主机上排队而其他主机空闲
+* 领取的任务有租约：租约到期仍未提交结果时重新入队，由其他编译服务领取，超过 pullMaxAttempts 次后放弃
+* 每次领取发放一个随机的租约号，提交结果时凭租约号，无法猜测其他任务的租约号伪造结果
+*/
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdio>
+
+#include "../comm/log.hpp"
+#include "../comm/util.hpp"
+
+namespace ns_dispatch
+{
+    using namespace ns_log;
+    using namespace ns_util;
+
+    const int pullQueueTimeoutSec = 30;  // 任务在队列中等待领取的最长时间 (s)，超过时判题失败
+    const int pullMaxAttempts = 2;       // 每个任务最多被领取的次数
+    const int pullMaxWaitMs = 20 * 1000; // 编译服务单次长轮询的最长等待时间 (ms)
+
+    // 分发判题任务的方式
+    enum class DispatchMode
+    {
+        Push, // oj_server选择主机后推送，默认
+        Pull, // 编译服务从中心队列领取
+    };
+
+    class JudgeQueue
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Task
+        {
+            std::string id;
+            std::vector<std::string> leases; // 每次领取发放的租约号
+            std::string request;  // compileJson
+            int leaseSec = 0;     // 领取后提交结果的期限 (s)
+            int attempts = 0;     // 已被领取的次数
+            bool queued = false;  // 是否在待领取队列中
+            bool done = false;
+            std::string result;
+            Clock::time_point deadline; // 排队中：等待领取的期限；已领取：租约到期时间
+        };
+
+    public:
+        /**
+         * @brief 提交任务并等待结果，由判题线程调用
+         * request：编译运行请求(compileJson)
+         * leaseSec：编译服务领取后提交结果的期限
+         * result：输出参数，编译服务提交的outJson
+         * return：排队超时或多次租约到期时为假
+         */
+        bool Submit(const std::string &request, int leaseSec, std::string *result)
+        {
+            std::shared_ptr<Task> task = std::make_shared<Task>();
+            task->id = FileUtil::UniqFileName();
+            task->request = request;
+            task->leaseSec = leaseSec;
+
+            std::unique_lock<std::mutex> lock(_mtx);
+            Enqueue(task, false);
+            while (!task->done)
+            {
+                _doneCond.wait_until(lock, task->deadline);
+                if (task->done || Clock::now() < task->deadline)
+                {
+                    continue;
+                }
+                if (task->queued)
+                {
+                    LOG(ERROR) << "判题任务等待领取超时，任务：" << task->id << std::endl;
+                    break;
+                }
+                // 租约到期，编译服务可能已崩溃或网络中断
+                if (task->attempts >= pullMaxAttempts)
+                {
+                    LOG(ERROR) << "判题任务多次租约到期，放弃，任务：" << task->id << std::endl;
+                    break;
+                }
+                LOG(WARNING) << "判题任务租约到期，重新入队，任务：" << task->id << std::endl;
+                Enqueue(task, true);
+            }
+            for (const auto &lease : task->leases)
+            {
+                _leases.erase(lease);
+            }
+            if (!task->done)
+            {
+                // 仍在队列中的任务在领取时跳过
+                task->done = true;
+                return false;
+            }
+            *result = task->result;
+            return true;
+        }
+
+        /**
+         * @brief 领取一个任务，由编译服务的长轮询调用
+         * waitMs：队列为空时最多等待的时间，超过 pullMaxWaitMs 时按 pullMaxWaitMs 计
+         * lease：输出参数，本次领取的租约号，提交结果时使用
+         * return：等待超时时为假
+         */
+        bool Fetch(int waitMs, std::string *lease, std::string *request)
+        {
+            if (waitMs > pullMaxWaitMs)
+            {
+                waitMs = pullMaxWaitMs;
+            }
+            Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(waitMs > 0 ? waitMs : 0);
+
+            std::unique_lock<std::mutex> lock(_mtx);
+            while (true)
+            {
+                while (!_pending.empty())
+                {
+                    std::shared_ptr<Task> task = _pending.front();
+                    _pending.pop_front();
+                    if (task->done) // 已放弃，或重新入队后收到了迟到的结果
+                    {
+                        continue;
+                    }
+                    task->queued = false;
+                    task->attempts++;
+                    task->deadline = Clock::now() + std::chrono::seconds(task->leaseSec);
+                    *lease = NewLease();
+                    task->leases.push_back(*lease);
+                    _leases[*lease] = task;
+                    *request = task->request;
+                    // 判题线程按租约重新计算等待时间
+                    _doneCond.notify_all();
+                    return true;
+                }
+                if (std::cv_status::timeout == _taskCond.wait_until(lock, deadline) && _pending.empty())
+                {
+                    return false;
+                }
+            }
+        }
+
+        /**
+         * @brief 提交任务结果
+         * lease：领取时发放的租约号
+         * return：租约号不存在(任务已放弃)或任务已完成时为假
+         *
+         * 租约到期后迟到的结果仍被接受，重新入队的任务随之完成
+         */
+        bool Complete(const std::string &lease, const std::string &result)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                auto iter = _leases.find(lease);
+                if (iter == _leases.end() || iter->second->done)
+                {
+                    return false;
+                }
+                iter->second->done = true;
+                iter->second->queued = false;
+                iter->second->result = result;
+            }
+            _doneCond.notify_all();
+            return true;
+        }
+
+    private:
+        /**
+         * @brief 生成128位随机的租约号，调用者持有锁
+         *
+         */
+        std::string NewLease()
+        {
+            std::string lease;
+            do
+            {
+                lease.clear();
+                for (int i = 0; i < 4; i++)
+                {
+                    char buf[9];
+                    snprintf(buf, sizeof(buf), "%08x", static_cast<unsigned>(_random()));
+                    lease += buf;
+                }
+            } while (_leases.count(lease));
+            return lease;
+        }
+
+        /**
+         * @brief 放入待领取队列，调用者持有锁
+         * front：租约到期重新入队的任务放在队首
+         */
+        void Enqueue(const std::shared_ptr<Task> &task, bool front)
+        {
+            task->queued = true;
+            task->deadline = Clock::now() + std::chrono::seconds(pullQueueTimeoutSec);
+            if (front)
+            {
+                _pending.push_front(task);
+            }
+            else
+            {
+                _pending.push_back(task);
+            }
+            _taskCond.notify_one();
+        }
+
+    private:
+        std::deque<std::shared_ptr<Task>> _pending;                     // 待领取的任务
+        std::unordered_map<std::string, std::shared_ptr<Task>> _leases; // 租约号->尚未返回给判题线程的任务
+        std::random_device _random;                                     // 操作系统的随机源
+        std::mutex _mtx;
+        std::condition_variable _taskCond; // 唤醒领取任务的长轮询
+        std::condition_variable _doneCond; // 唤醒等待结果的判题线程
+    };
+}
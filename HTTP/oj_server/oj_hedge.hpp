@@ -0,0 +1,131 @@
+/*
+* 对冲请求
+* 判题请求超过近期延迟的指定分位数仍未返回时，把同一任务再发给另一台主机，先返回成功结果的一方胜出，另一方被取消
+* 对冲请求受预算约束：每个主请求存入 budgetRatio 个令牌，每次对冲取出一个；同时进行的对冲数不超过主请求数
+* 因此对冲最多使编译服务的负载翻倍，主机普遍变慢时不会因对冲雪崩
+*/
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+namespace ns_hedge
+{
+    const size_t hedgeWindowSize = 256; // 参与计算分位数的最近成功请求数
+    const size_t hedgeMinSamples = 20;  // 样本不足时不对冲
+    const double hedgeMinDelayMs = 50;  // 对冲等待时间的下限 (ms)
+    const double hedgeBudgetBurst = 10; // 令牌数上限，即允许的突发对冲数
+    const long hedgePollWaitMs = 200;   // 对冲开始后单次长轮询的最长等待时间 (ms)，使被取消的一方及时退出
+
+    struct HedgeOptions
+    {
+        bool enabled = false;     // 默认关闭
+        double percentile = 95;   // 等待时间取近期延迟的该分位数
+        double budgetRatio = 0.1; // 每个主请求允许的对冲数，不超过1
+    };
+
+    // 最近成功请求的延迟，环形缓冲区
+    class LatencyWindow
+    {
+    public:
+        LatencyWindow() : _samples(hedgeWindowSize), _next(0), _count(0) {}
+
+        void Record(double latencyMs)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _samples[_next] = latencyMs;
+            _next = (_next + 1) % _samples.size();
+            if (_count < _samples.size())
+            {
+                ++_count;
+            }
+        }
+
+        /**
+         * @brief 计算延迟的分位数
+         * p：分位数，0~100
+         * return：样本不足 hedgeMinSamples 时为假
+         */
+        bool Percentile(double p, double *latencyMs)
+        {
+            std::vector<double> samples;
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                if (_count < hedgeMinSamples)
+                {
+                    return false;
+                }
+                samples.assign(_samples.begin(), _samples.begin() + _count);
+            }
+            size_t k = std::min(samples.size() - 1, (size_t)(p / 100 * samples.size()));
+            std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+            *latencyMs = samples[k];
+            return true;
+        }
+
+    private:
+        std::vector<double> _samples;
+        size_t _next;
+        size_t _count;
+        std::mutex _mtx;
+    };
+
+    // 对冲预算：令牌桶 + 进行中的请求数
+    class HedgeBudget
+    {
+    public:
+        HedgeBudget() : _ratio(0), _tokens(0), _primary(0), _hedges(0) {}
+
+        void SetRatio(double ratio)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _ratio = std::max(0.0, std::min(1.0, ratio));
+        }
+
+        /**
+         * @brief 主请求开始/结束，开始时存入令牌
+         *
+         */
+        void BeginPrimary()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            ++_primary;
+            _tokens = std::min(hedgeBudgetBurst, _tokens + _ratio);
+        }
+        void EndPrimary()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            --_primary;
+        }
+
+        /**
+         * @brief 申请发起一次对冲，成功后对冲结束时调用 Release
+         * return：令牌不足或进行中的对冲数已达主请求数时为假
+         */
+        bool TryAcquire()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_tokens < 1 || _hedges >= _primary)
+            {
+                return false;
+            }
+            _tokens -= 1;
+            ++_hedges;
+            return true;
+        }
+        void Release()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            --_hedges;
+        }
+
+    private:
+        double _ratio;
+        double _tokens;
+        int _primary; // 进行中的主请求数
+        int _hedges;  // 进行中的对冲请求数
+        std::mutex _mtx;
+    };
+}
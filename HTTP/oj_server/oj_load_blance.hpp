@@ -0,0 +1,1232 @@
+/*
+* 负载均衡模块
+* 主机的负载计数为独占缓存行的原子变量，判题线程增减计数时不加锁
+* 在线/离线主机列表以只读快照发布：选择主机时原子地取得当前快照，上线/离线时复制、修改后整体替换
+* 选择主机使用 power of two choices：按权重随机取两台在线主机，选择代价较低的一台
+* 代价综合了饱和程度与判题请求延迟、错误率的滑动平均
+* 离线主机由探测线程按指数退避的间隔探测，恢复响应后单独上线
+* 连接失败的主机离线；读写超时等失败计入主机的熔断器，熔断中的主机不被选择
+* 监视主机配置文件，修改后增加新主机、摘除被删除的主机(不再选择，等待其上的请求结束)，整体替换快照，不重启服务
+* 亲和路由模式下按题号在一致性哈希环上选择主机，使同一题目的缓存(测试框架目标文件等)集中在少数主机上
+* 环上的主机负载超过平均负载的 affinityLoadFactor 倍时顺延到下一台(有界负载)，都不满足时按 power of two choices 选择
+* 装箱模式下按题目的内存限制为每台主机预留内存，在内存与CPU槽位都放得下的主机中选择剩余空间最小的(best fit)
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <new>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <assert.h>
+#include <jsoncpp/json/json.h>
+
+#include "../comm/log.hpp"
+#include "../comm/util.hpp"
+#include "../comm/httplib.h"
+#include "./oj_breaker.hpp"
+
+namespace ns_load_blance
+{
+    using namespace ns_log;
+    using namespace ns_util;
+    using namespace ns_breaker;
+
+    const std::string serviceMachinePath = "conf/service_machine.conf"; // oj_server/conf/service_machine.conf
+    const int loadPollIntervalMs = 500;                                 // 拉取编译服务负载的间隔 (ms)
+    const int loadPollTimeoutMs = 300;                                  // 拉取负载的连接/读超时 (ms)
+    const int loadReportStaleMs = 3 * 1000;                             // 负载上报超过该时间未更新则不再采用 (ms)
+    const int loadPollThreads = 8;                                      // 并发拉取负载的线程数
+    const int loadPollMaxBackoffShift = 4;                              // 拉取失败后的退避上限：拉取间隔 * 2^4
+    const long loadLowMemKB = 512 * 1024;                               // 可用内存低于该值时视为满载 (KB)
+    const int probeTimeoutMs = 500;                                     // 探测离线主机的连接/读超时 (ms)
+    const int probeInitialBackoffMs = 500;                              // 主机离线后第一次探测的等待时间 (ms)
+    const int probeMaxBackoffMs = 30 * 1000;                            // 探测间隔的上限 (ms)，每次失败后翻倍
+    const double ewmaAlpha = 0.2;                                       // 延迟/错误率滑动平均中新样本的权重
+    const double latencyFloorMs = 1;                                    // 参与计算的延迟下限 (ms)，没有有效样本的主机按此计
+    const double errorPenalty = 4;                                      // 错误率对代价的放大系数：代价 *= 1 + errorPenalty * 错误率
+    const int latencyStaleMs = 10 * 1000;                               // 超过该时间没有新样本时忽略延迟与错误率 (ms)，使主机重新被尝试
+    const size_t cacheLineSize = 64;                                    // 缓存行大小 (B)
+    const int choiceMaxAttempts = 3;                                    // 半开主机的试探名额被抢占时重新选择的次数
+    const int ringVnodesPerWeight = 64;                                 // 一致性哈希环上每单位权重的虚拟节点数
+    const double affinityLoadFactor = 1.25;                             // 亲和路由的有界负载系数：主机负载不超过 平均负载*系数*权重
+    const int confReloadDelayMs = 200;                                  // 配置文件变化后等待该时间再加载，合并连续的写入 (ms)
+    const double binpackMemFraction = 0.8;                              // 装箱时主机内存总量中可预留给判题请求的比例，其余留给系统与编译
+
+    // 编译服务通过 /load 上报的负载
+    struct LoadReport
+    {
+        uint64_t running = 0;    // 执行中的请求数
+        uint64_t queued = 0;     // 排队中的请求数
+        int cores = 1;           // CPU核数
+        double loadAvg = 0;      // 最近1分钟平均负载
+        long memAvailableKB = 0; // 可用内存 (KB)
+        long memTotalKB = 0;     // 内存总量 (KB)，0为未上报
+    };
+
+    // 独占一个缓存行的原子计数器，不同主机、不同计数器之间没有伪共享
+    struct alignas(cacheLineSize) PaddedCounter
+    {
+        std::atomic<int64_t> value;
+        PaddedCounter() : value(0) {}
+    };
+
+    class Machine // 主机
+    {
+    public:
+        Machine()
+            : _ip(""), _port(0), _weight(0), _reportBase(0), _reportCores(1), _reportTimeMs(0), _memCapacityKB(0), _latencyMs(0), _errorRate(0), _sampleTimeMs(0)
+        {
+        }
+        ~Machine() {}
+        Machine(const Machine &) = delete;
+        Machine &operator=(const Machine &) = delete;
+
+        // C++11的new不保证超过16字节的对齐，按缓存行对齐分配
+        static void *operator new(size_t size)
+        {
+            void *p = nullptr;
+            if (0 != posix_memalign(&p, cacheLineSize, size))
+            {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+        static void operator delete(void *p)
+        {
+            free(p);
+        }
+
+        void SetPort(int port)
+        {
+            _port = port;
+        }
+        int GetPort()
+        {
+            return _port;
+        }
+        void SetIp(const std::string &ip)
+        {
+            _ip = ip;
+        }
+        std::string GetIp()
+        {
+            return _ip;
+        }
+        /**
+         * @brief 配置的容量(可同时处理的请求数)，0为未配置，按上报的CPU核数计
+         *
+         */
+        void SetWeight(int weight)
+        {
+            _weight.store(weight, std::memory_order_relaxed);
+            _reportCores.store(weight > 0 ? weight : 1, std::memory_order_relaxed);
+        }
+        int GetWeight()
+        {
+            return _weight.load(std::memory_order_relaxed);
+        }
+        uint64_t GetLoad()
+        {
+            int64_t load = _load.value.load(std::memory_order_relaxed);
+            return load > 0 ? load : 0;
+        }
+
+        /**
+         * @brief 增加主机负载
+         * memKB：为该请求预留的内存，即题目的内存限制 (KB)
+         */
+        void IncLoad(int64_t memKB = 0)
+        {
+            _load.value.fetch_add(1, std::memory_order_relaxed);
+            _pending.value.fetch_add(1, std::memory_order_relaxed);
+            _memReserved.value.fetch_add(memKB, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 减少主机负载，memKB与IncLoad时相同
+         * 每次IncLoad对应且只对应一次DecLoad，包括连接失败、主机离线的请求；离线不清零计数
+         */
+        void DecLoad(int64_t memKB = 0)
+        {
+            _load.value.fetch_sub(1, std::memory_order_relaxed);
+            _memReserved.value.fetch_sub(memKB, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 本机发出、尚未完成的请求预留的内存 (KB)
+         *
+         */
+        int64_t GetMemReservedKB()
+        {
+            int64_t reserved = _memReserved.value.load(std::memory_order_relaxed);
+            return reserved > 0 ? reserved : 0;
+        }
+
+        /**
+         * @brief 可预留给判题请求的内存 (KB)，上报的内存总量 * binpackMemFraction，0为未上报
+         *
+         */
+        int64_t GetMemCapacityKB()
+        {
+            return _memCapacityKB.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief CPU槽位数，即容量：配置的权重，未配置时为上报的CPU核数
+         *
+         */
+        int GetSlots()
+        {
+            return _reportCores.load(std::memory_order_relaxed);
+        }
+        /**
+         * @brief 使上报失效，主机离线或摘除完成时调用
+         * 执行中的请求仍由DecLoad归还，不清零_load与_memReserved
+         */
+        void ResetReport()
+        {
+            _pending.value.store(0, std::memory_order_relaxed);
+            _reportTimeMs.store(0, std::memory_order_release);
+        }
+
+        /**
+         * @brief 记录编译服务上报的负载，只由负载拉取线程调用
+         * 上报之后本机新发出的请求计入_pending，直到下一次上报
+         */
+        void SetReport(const LoadReport &report)
+        {
+            int cores = report.cores > 0 ? report.cores : 1;
+            int weight = GetWeight();
+            double jobs = static_cast<double>(report.running + report.queued) / (weight > 0 ? weight : cores);
+            double base = std::max(jobs, report.loadAvg / cores);
+            if (report.memAvailableKB < loadLowMemKB)
+            {
+                base += 1;
+            }
+            _reportBase.store(base, std::memory_order_relaxed);
+            _reportCores.store(weight > 0 ? weight : cores, std::memory_order_relaxed);
+            _memCapacityKB.store(static_cast<int64_t>(report.memTotalKB * binpackMemFraction), std::memory_order_relaxed);
+            _pending.value.store(0, std::memory_order_relaxed);
+            _reportTimeMs.store(NowMs(), std::memory_order_release);
+        }
+
+        /**
+         * @brief 主机的饱和程度，越小越空闲
+         * 容量：配置的权重，未配置时为上报的CPU核数
+         * 上报有效时：max((执行中+排队中)/容量, 平均负载/核数) + 上报后新发出的请求/容量，可用内存不足时再加1
+         * 上报无效时：本机发出、尚未完成的请求数/容量
+         * 各项分别原子读取，与上报同时发生时可能混合新旧值，只影响一次选择
+         */
+        double GetScore()
+        {
+            int64_t reportTime = _reportTimeMs.load(std::memory_order_acquire);
+            int capacity = _reportCores.load(std::memory_order_relaxed);
+            if (reportTime > 0 && NowMs() - reportTime < loadReportStaleMs)
+            {
+                int64_t pending = _pending.value.load(std::memory_order_relaxed);
+                return _reportBase.load(std::memory_order_relaxed) + static_cast<double>(pending > 0 ? pending : 0) / capacity;
+            }
+            return static_cast<double>(GetLoad()) / capacity;
+        }
+
+        /**
+         * @brief 记录一次判题请求的结果，由判题线程调用
+         * latencyMs：从提交到得到结果(或失败)的时间
+         * success：是否得到了结果，503(繁忙)、被取消的请求调用 RecordCancel
+         *
+         * 延迟与错误率为指数加权滑动平均，第一个延迟样本直接作为初值；结果同时计入熔断器
+         */
+        void RecordResult(double latencyMs, bool success)
+        {
+            if (_breaker.OnResult(success))
+            {
+                LOG(WARNING) << "主机熔断，主机：" << _ip << ":" << _port << "，" << breakerOpenMs << "ms后试探\n";
+            }
+            double old = _latencyMs.load(std::memory_order_relaxed);
+            while (!_latencyMs.compare_exchange_weak(old, old > 0 ? old + ewmaAlpha * (latencyMs - old) : latencyMs, std::memory_order_relaxed))
+            {
+            }
+            old = _errorRate.load(std::memory_order_relaxed);
+            while (!_errorRate.compare_exchange_weak(old, old + ewmaAlpha * ((success ? 0 : 1) - old), std::memory_order_relaxed))
+            {
+            }
+            _sampleTimeMs.store(NowMs(), std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 选择主机时比较的代价，越小越好
+         * 代价 = (饱和程度 + 1) * 延迟 * (1 + errorPenalty * 错误率)
+         * 饱和程度相同时，慢的、出错多的主机代价更高
+         * 没有样本或样本已过期(latencyStaleMs)的主机只按饱和程度计，会先被尝试，从而更新延迟与错误率
+         */
+        double GetCost()
+        {
+            if (NowMs() - _sampleTimeMs.load(std::memory_order_relaxed) >= latencyStaleMs)
+            {
+                return (GetScore() + 1) * latencyFloorMs;
+            }
+            double latency = std::max(_latencyMs.load(std::memory_order_relaxed), latencyFloorMs);
+            double errorRate = _errorRate.load(std::memory_order_relaxed);
+            return (GetScore() + 1) * latency * (1 + errorPenalty * errorRate);
+        }
+        /**
+         * @brief 请求被取消或被拒绝(503)，不计入结果
+         *
+         */
+        void RecordCancel()
+        {
+            _breaker.OnCancel();
+        }
+        CircuitBreaker &GetBreaker()
+        {
+            return _breaker;
+        }
+        double GetLatencyMs()
+        {
+            return _latencyMs.load(std::memory_order_relaxed);
+        }
+        double GetErrorRate()
+        {
+            return _errorRate.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 负载拉取线程开始拉取本主机
+         * 同一主机同一时刻只由一个线程拉取，无响应的主机最多占用一个拉取线程
+         * return：正在被拉取或拉取失败后的退避未结束时为假
+         */
+        bool TryBeginPoll()
+        {
+            if (NowMs() < _pollNextMs.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+            bool expected = false;
+            return _polling.compare_exchange_strong(expected, true, std::memory_order_acquire);
+        }
+
+        /**
+         * @brief 结束拉取，连续失败时按 loadPollIntervalMs 的倍数指数退避
+         *
+         */
+        void EndPoll(bool ok)
+        {
+            int fails = ok ? 0 : std::min(_pollFails.load(std::memory_order_relaxed) + 1, loadPollMaxBackoffShift);
+            _pollFails.store(fails, std::memory_order_relaxed);
+            _pollNextMs.store(ok ? 0 : NowMs() + (static_cast<int64_t>(loadPollIntervalMs) << fails), std::memory_order_relaxed);
+            _polling.store(false, std::memory_order_release);
+        }
+
+        /**
+         * @brief 上一次拉取是否失败
+         *
+         */
+        bool PollFailing()
+        {
+            return _pollFails.load(std::memory_order_relaxed) > 0;
+        }
+
+        /**
+         * @brief 拉取负载使用的持久连接，只由TryBeginPoll成功的线程使用
+         *
+         */
+        httplib::Client &PollClient()
+        {
+            if (!_pollClient)
+            {
+                _pollClient.reset(new httplib::Client(_ip, _port));
+                _pollClient->set_connection_timeout(0, loadPollTimeoutMs * 1000);
+                _pollClient->set_read_timeout(0, loadPollTimeoutMs * 1000);
+                _pollClient->set_keep_alive(true);
+            }
+            return *_pollClient;
+        }
+
+    private:
+        static int64_t NowMs()
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    private:
+        std::string _ip;
+        int _port;
+        std::atomic<int> _weight; // 配置的容量，0为未配置，重新加载配置时可能修改
+        PaddedCounter _load;      // 本机发出、尚未完成的请求数，判题线程频繁修改
+        PaddedCounter _pending;   // 上一次上报之后本机发出的请求数
+        PaddedCounter _memReserved; // 本机发出、尚未完成的请求预留的内存 (KB)
+        // 最近一次上报，只由负载拉取线程写入
+        alignas(cacheLineSize) std::atomic<double> _reportBase; // 上报时的饱和程度
+        std::atomic<int> _reportCores;                           // 容量，配置了权重时为权重，否则为CPU核数
+        std::atomic<int64_t> _reportTimeMs;                      // 上报时间 (ms)，0为无有效上报
+        std::atomic<int64_t> _memCapacityKB;                     // 可预留给判题请求的内存 (KB)，0为未上报
+        // 判题请求的统计，由判题线程写入
+        alignas(cacheLineSize) std::atomic<double> _latencyMs;   // 延迟的滑动平均 (ms)，0为无样本
+        std::atomic<double> _errorRate;                          // 错误率的滑动平均
+        std::atomic<int64_t> _sampleTimeMs;                      // 最近一次样本的时间 (ms)
+        CircuitBreaker _breaker;                                 // 熔断器，判题线程写入
+        // 负载拉取，_polling为真的线程独占_pollClient
+        std::atomic<bool> _polling{false};
+        std::atomic<int64_t> _pollNextMs{0};                     // 拉取失败后，下一次拉取的最早时间 (ms)
+        std::atomic<int> _pollFails{0};                          // 连续拉取失败的次数，不超过 loadPollMaxBackoffShift
+        std::unique_ptr<httplib::Client> _pollClient;
+    };
+
+    // 选择主机的方式
+    enum class RouteMode
+    {
+        P2C,      // power of two choices，默认
+        Affinity, // 按题号的一致性哈希，有界负载
+        BinPack,  // 按内存与CPU槽位装箱，best fit
+    };
+
+    // 在线/离线主机列表的快照，发布后只读
+    struct Membership
+    {
+        std::vector<std::shared_ptr<Machine>> machines; // 下标即代表主机id，只增不减：被删除的主机保留对象，判题线程持有的指针始终有效
+        std::vector<int> online;   // 在线主机ID
+        std::vector<int> offline;  // 离线主机ID
+        std::vector<int> draining; // 已从配置中删除、尚有请求未结束的主机ID，不再被选择
+        std::vector<uint64_t> cumWeight; // 在线主机权重的前缀和，按权重抽样，未配置权重的主机按1计
+        std::vector<std::pair<uint64_t, int>> ring; // 在线主机的一致性哈希环：(虚拟节点哈希值, 主机ID)，按哈希值排序
+    };
+
+    class LoadBlance // 负载均衡
+    {
+    public:
+        LoadBlance()
+            : _membership(std::make_shared<Membership>()), _routeMode(RouteMode::P2C), _pollStop(false)
+        {
+            // 先开始监视再加载，加载之后的修改不会遗漏
+            _confFd = WatchConfInit(serviceMachinePath);
+            assert(LoadConf(serviceMachinePath));
+            _poller = std::thread(&LoadBlance::PollLoad, this);
+            _prober = std::thread(&LoadBlance::ProbeOffline, this);
+            _watcher = std::thread(&LoadBlance::WatchConf, this, serviceMachinePath);
+        }
+        ~LoadBlance()
+        {
+            _pollStop = true;
+            _poller.join();
+            _prober.join();
+            _watcher.join();
+            if (_confFd >= 0)
+            {
+                close(_confFd);
+            }
+        }
+
+        /**
+         * @brief 加载所有主机，启动时与配置文件修改后调用
+         * serviceMachineConf: 主机配置信息文件路径
+         * return：文件无法打开或没有有效主机时为假，保持当前的主机列表
+         *
+         * 每行一台主机：ip:port[:weight]
+         * weight为主机的容量(可同时处理的请求数，如CPU核数)，负载按 负载/容量 比较，抽样概率与weight成正比
+         * 省略weight时负载按编译服务上报的CPU核数计，抽样按1计
+         *
+         * 按 ip:port 与当前主机对比：新主机上线，已有主机更新权重、保留在线/离线状态，
+         * 被删除的主机移入摘除列表，被删除过的主机重新出现在配置中时沿用原id直接上线
+         */
+        bool LoadConf(const std::string &serviceMachineConf)
+        {
+            std::ifstream in(serviceMachineConf);
+            if (!in.is_open())
+            {
+                LOG(FATAL) << "主机配置文件加载失败\n";
+                return false;
+            }
+            std::vector<std::pair<std::string, int>> confs; // (ip:port, weight)
+            std::string line;
+            while (getline(in, line))
+            {
+                std::vector<std::string> strs;
+                StringUtil::SplitString(line, &strs, ":");
+                if (2 != strs.size() && 3 != strs.size())
+                {
+                    LOG(WARING) << "主机信息错误：" << line << std::endl;
+                    continue;
+                }
+                int weight = 3 == strs.size() ? atoi(strs[2].c_str()) : 0;
+                if (3 == strs.size() && weight <= 0)
+                {
+                    LOG(WARING) << "主机权重错误：" << line << std::endl;
+                    continue;
+                }
+                confs.push_back(std::make_pair(strs[0] + ":" + strs[1], weight));
+            }
+            in.close();
+            if (confs.empty())
+            {
+                LOG(ERROR) << "主机配置文件中没有有效主机，保持当前配置\n";
+                return false;
+            }
+
+            std::lock_guard<std::mutex> lock(_mtx);
+            std::shared_ptr<Membership> membership = std::make_shared<Membership>(*std::atomic_load(&_membership));
+            std::unordered_map<std::string, int> ids; // ip:port -> 主机id
+            for (size_t id = 0; id < membership->machines.size(); id++)
+            {
+                Machine &m = *membership->machines[id];
+                ids[m.GetIp() + ":" + std::to_string(m.GetPort())] = id;
+            }
+
+            std::vector<bool> keep(membership->machines.size(), false);
+            for (auto &conf : confs)
+            {
+                auto iter = ids.find(conf.first);
+                if (iter == ids.end())
+                {
+                    size_t colon = conf.first.rfind(':');
+                    std::shared_ptr<Machine> m(new Machine());
+                    m->SetIp(conf.first.substr(0, colon));
+                    m->SetPort(atoi(conf.first.c_str() + colon + 1));
+                    m->SetWeight(conf.second);
+                    ids[conf.first] = membership->machines.size();
+                    membership->online.push_back(membership->machines.size());
+                    membership->machines.push_back(m);
+                    keep.push_back(true);
+                    LOG(INFO) << "新增主机，主机ID：" << membership->machines.size() - 1 << "，主机：" << conf.first << std::endl;
+                    continue;
+                }
+                int id = iter->second;
+                if (keep[id]) // 重复的行
+                {
+                    continue;
+                }
+                keep[id] = true;
+                membership->machines[id]->SetWeight(conf.second);
+                // 正在摘除或已摘除完成的主机重新上线
+                bool listed = std::find(membership->online.begin(), membership->online.end(), id) != membership->online.end() ||
+                              std::find(membership->offline.begin(), membership->offline.end(), id) != membership->offline.end();
+                if (!listed)
+                {
+                    auto draining = std::find(membership->draining.begin(), membership->draining.end(), id);
+                    if (draining != membership->draining.end())
+                    {
+                        membership->draining.erase(draining);
+                    }
+                    membership->online.push_back(id);
+                    membership->machines[id]->GetBreaker().Reset();
+                    LOG(INFO) << "主机重新加入，主机ID：" << id << "，主机：" << conf.first << std::endl;
+                }
+            }
+
+            // 配置中已删除的主机停止选择，等待其上的请求结束
+            for (std::vector<int> *list : {&membership->online, &membership->offline})
+            {
+                for (auto iter = list->begin(); iter != list->end();)
+                {
+                    if (keep[*iter])
+                    {
+                        ++iter;
+                        continue;
+                    }
+                    LOG(INFO) << "摘除主机，主机ID：" << *iter << "，主机：" << membership->machines[*iter]->GetIp() << ":" << membership->machines[*iter]->GetPort() << std::endl;
+                    membership->draining.push_back(*iter);
+                    iter = list->erase(iter);
+                }
+            }
+            Publish(membership);
+
+            LOG(INFO) << "主机配置文件加载成功，在线：" << membership->online.size() << "，离线：" << membership->offline.size()
+                      << "，摘除中：" << membership->draining.size() << std::endl;
+            return true;
+        }
+
+        /**
+         * @brief 选择负载较低的主机提供编译运行服务
+         * *id： 选择的主机的id
+         * *m：选择的主机的对象的地址
+         * excludeId：不参与选择的主机id(选填)，对冲请求用于避开主请求所在的主机
+         * return：真为成功
+         *
+         * 按权重随机取两台在线主机，选择代价(饱和程度、延迟、错误率)较低的一台，不加锁、不遍历全部主机
+         */
+        bool SmartChoice(int *id, Machine **m, int excludeId = -1)
+        {
+            std::shared_ptr<const Membership> membership = std::atomic_load(&_membership);
+            const std::vector<int> &online = membership->online;
+
+            size_t onlineNum = online.size();
+            if (0 == onlineNum) // 无在线主机
+            {
+                LOG(FATAL) << "所有主机全部离线，请注意，请注意！\n";
+                return false;
+            }
+
+            for (int attempt = 0; attempt < choiceMaxAttempts; attempt++)
+            {
+                // 跳过被排除、熔断中的主机，抽中时取下一台可用的
+                size_t first = NextUsable(*membership, Sample(*membership), onlineNum, excludeId);
+                if (first == onlineNum) // 没有可用主机
+                {
+                    break;
+                }
+                *id = online[first];
+                if (onlineNum > 1)
+                {
+                    // 第二台与第一台不同，重复抽中时取下一台
+                    size_t second = Sample(*membership);
+                    if (second == first)
+                    {
+                        second = (first + 1) % onlineNum;
+                    }
+                    second = NextUsable(*membership, second, first, excludeId);
+                    if (second != first && second != onlineNum && membership->machines[online[second]]->GetCost() < membership->machines[*id]->GetCost())
+                    {
+                        *id = online[second];
+                    }
+                }
+                *m = membership->machines[*id].get();
+                // 半开的主机只放行一个试探请求，名额已被占用时重新选择
+                if ((*m)->GetBreaker().Acquire())
+                {
+                    return true;
+                }
+            }
+            LOG(WARNING) << "没有可用的主机(熔断中或被排除)\n";
+            return false;
+        }
+
+        /**
+         * @brief 设置选择主机的方式，服务启动时、处理请求之前调用
+         *
+         */
+        void SetRouteMode(RouteMode mode)
+        {
+            _routeMode = mode;
+        }
+
+        /**
+         * @brief 按当前的路由方式为一次判题请求选择主机
+         * key：亲和路由的键，即题号
+         * memKB：装箱模式下请求需要的内存，即题目的内存限制 (KB)
+         *
+         */
+        bool Choice(const std::string &key, int64_t memKB, int *id, Machine **m)
+        {
+            if (_routeMode == RouteMode::Affinity && AffinityChoice(key, id, m))
+            {
+                return true;
+            }
+            if (_routeMode == RouteMode::BinPack && BinPackChoice(memKB, id, m))
+            {
+                return true;
+            }
+            return SmartChoice(id, m);
+        }
+
+        /**
+         * @brief 装箱：在预留内存与CPU槽位都放得下的主机中，选择放入后剩余空间最小的一台
+         * 剩余空间 = 剩余内存/可预留内存 + 剩余槽位/槽位数，未上报内存总量的主机只按槽位计
+         * 都放不下时选择剩余内存比例最大的一台，使内存压力分散；没有可用主机时为假，由调用者改用 SmartChoice
+         *
+         * 大内存的题目集中到尚有空间的主机上，小内存的题目填充剩余空间，不会使一台主机同时运行过多大内存请求
+         */
+        bool BinPackChoice(int64_t memKB, int *id, Machine **m)
+        {
+            std::shared_ptr<const Membership> membership = std::atomic_load(&_membership);
+            std::vector<bool> tried(membership->machines.size(), false);
+
+            for (int attempt = 0; attempt < choiceMaxAttempts; attempt++)
+            {
+                int best = -1, spare = -1;
+                double bestResidual = 0, spareMem = 0;
+                for (int candidate : membership->online)
+                {
+                    Machine &machine = *membership->machines[candidate];
+                    if (tried[candidate] || !machine.GetBreaker().Available())
+                    {
+                        continue;
+                    }
+                    int64_t capacity = machine.GetMemCapacityKB();
+                    int64_t memLeft = capacity - machine.GetMemReservedKB() - memKB;
+                    int slots = machine.GetSlots();
+                    int64_t slotsLeft = slots - static_cast<int64_t>(machine.GetLoad()) - 1;
+                    double memRatio = capacity > 0 ? static_cast<double>(memLeft) / capacity : 1;
+                    if ((capacity > 0 && memLeft < 0) || slotsLeft < 0)
+                    {
+                        if (spare < 0 || memRatio > spareMem)
+                        {
+                            spare = candidate;
+                            spareMem = memRatio;
+                        }
+                        continue;
+                    }
+                    double residual = (capacity > 0 ? memRatio : 0) + static_cast<double>(slotsLeft) / slots;
+                    if (best < 0 || residual < bestResidual)
+                    {
+                        best = candidate;
+                        bestResidual = residual;
+                    }
+                }
+                int chosen = best >= 0 ? best : spare;
+                if (chosen < 0)
+                {
+                    return false;
+                }
+                tried[chosen] = true;
+                if (membership->machines[chosen]->GetBreaker().Acquire())
+                {
+                    *id = chosen;
+                    *m = membership->machines[chosen].get();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @brief 亲和路由：从key在一致性哈希环上的位置顺时针查找第一台可用且负载未超过上限的主机
+         * 上限 = ceil(affinityLoadFactor * (全部在线主机的负载 + 1) / 总权重 * 本机权重)，负载为本机发出、尚未完成的请求数
+         * 熔断中的主机同样顺延
+         * return：环上没有满足条件的主机时为假，由调用者改用 SmartChoice
+         *
+         * 主机上线/离线时只有相邻区间的题目改变归属，熔断、超载时顺延的题目在恢复后回到原主机
+         */
+        bool AffinityChoice(const std::string &key, int *id, Machine **m)
+        {
+            std::shared_ptr<const Membership> membership = std::atomic_load(&_membership);
+            const std::vector<std::pair<uint64_t, int>> &ring = membership->ring;
+            if (ring.empty())
+            {
+                return false;
+            }
+
+            uint64_t totalLoad = 1; // 计入本次请求
+            uint64_t totalWeight = 0;
+            for (int online : membership->online)
+            {
+                totalLoad += membership->machines[online]->GetLoad();
+                totalWeight += WeightOf(*membership->machines[online]);
+            }
+            double average = static_cast<double>(totalLoad) / totalWeight;
+
+            std::vector<bool> visited(membership->machines.size(), false);
+            size_t remain = membership->online.size();
+            auto iter = std::lower_bound(ring.begin(), ring.end(), std::make_pair(MixHash(StringUtil::Hash(key)), -1));
+            for (size_t i = 0; i < ring.size() && remain > 0; i++, iter++)
+            {
+                if (iter == ring.end())
+                {
+                    iter = ring.begin();
+                }
+                int candidate = iter->second;
+                if (visited[candidate])
+                {
+                    continue;
+                }
+                visited[candidate] = true;
+                --remain;
+
+                Machine *machine = membership->machines[candidate].get();
+                uint64_t bound = static_cast<uint64_t>(std::ceil(affinityLoadFactor * average * WeightOf(*machine)));
+                if (machine->GetLoad() + 1 > bound || !machine->GetBreaker().Acquire())
+                {
+                    continue;
+                }
+                *id = candidate;
+                *m = machine;
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief 离线指定主机
+         *
+         */
+        void OfflineMachine(int machineId)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            std::shared_ptr<Membership> membership = std::make_shared<Membership>(*std::atomic_load(&_membership));
+
+            auto iter = std::find(membership->online.begin(), membership->online.end(), machineId);
+            if (iter == membership->online.end())
+            {
+                return;
+            }
+            membership->machines[machineId]->ResetReport();
+            membership->online.erase(iter);
+            membership->offline.push_back(machineId);
+            Publish(membership);
+        }
+
+        /**
+         * @brief 上线指定主机，由探测线程在主机恢复响应后调用
+         *
+         */
+        void OnlineMachine(int machineId)
+        {
+            std::shared_ptr<Machine> m;
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                std::shared_ptr<Membership> membership = std::make_shared<Membership>(*std::atomic_load(&_membership));
+
+                auto iter = std::find(membership->offline.begin(), membership->offline.end(), machineId);
+                if (iter == membership->offline.end())
+                {
+                    return;
+                }
+                membership->offline.erase(iter);
+                membership->online.push_back(machineId);
+                m = membership->machines[machineId];
+                m->GetBreaker().Reset();
+                Publish(membership);
+            }
+
+            LOG(INFO) << "主机恢复上线，主机ID：" << machineId << "，主机：" << m->GetIp() << ":" << m->GetPort() << std::endl;
+        }
+
+        /**
+         * @brief 上线所有主机
+         * 当所有主机离线时，上线所有主机
+         */
+        void OnlineMachine()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                std::shared_ptr<Membership> membership = std::make_shared<Membership>(*std::atomic_load(&_membership));
+
+                for (int id : membership->offline)
+                {
+                    membership->machines[id]->GetBreaker().Reset();
+                }
+                membership->online.insert(membership->online.end(), membership->offline.begin(), membership->offline.end());
+                membership->offline.clear();
+                Publish(membership);
+            }
+
+            LOG(INFO) << "重新上线所有主机!\n";
+        }
+
+        /**
+         * @brief 显示在线主机，for test
+         *
+         */
+        void ShowMachines()
+        {
+            std::shared_ptr<const Membership> membership = std::atomic_load(&_membership);
+            std::cout << "在线主机列表：";
+            for (auto &id : membership->online)
+            {
+                std::cout << id << " ";
+            }
+            std::cout << "\n离线主机列表：";
+            for (auto &id : membership->offline)
+            {
+                std::cout << id << " ";
+            }
+            std::cout << "\n摘除中主机列表：";
+            for (auto &id : membership->draining)
+            {
+                std::cout << id << " ";
+            }
+            std::cout << std::endl;
+        }
+
+    private:
+        /**
+         * @brief 重建权重前缀和并发布新的主机列表，调用者持有_mtx或处于加载阶段
+         *
+         */
+        void Publish(const std::shared_ptr<Membership> &membership)
+        {
+            membership->cumWeight.clear();
+            membership->ring.clear();
+            uint64_t sum = 0;
+            for (int id : membership->online)
+            {
+                Machine &m = *membership->machines[id];
+                int weight = WeightOf(m);
+                sum += weight;
+                membership->cumWeight.push_back(sum);
+                // 虚拟节点的哈希值只取决于主机地址，与主机在列表中的位置无关
+                std::string addr = m.GetIp() + ":" + std::to_string(m.GetPort()) + "#";
+                for (int i = 0; i < weight * ringVnodesPerWeight; i++)
+                {
+                    membership->ring.push_back(std::make_pair(MixHash(StringUtil::Hash(addr + std::to_string(i))), id));
+                }
+            }
+            std::sort(membership->ring.begin(), membership->ring.end());
+            std::atomic_store(&_membership, std::shared_ptr<const Membership>(membership));
+        }
+
+        /**
+         * @brief 抽样与哈希环使用的权重，未配置权重的主机按1计
+         *
+         */
+        static int WeightOf(Machine &m)
+        {
+            int weight = m.GetWeight();
+            return weight > 0 ? weight : 1;
+        }
+
+        /**
+         * @brief 打散哈希值的各位(splitmix64的终结步骤)
+         * 虚拟节点的键只有末尾几个字符不同，FNV-1a的结果在环上分布不够均匀
+         */
+        static uint64_t MixHash(uint64_t h)
+        {
+            h ^= h >> 30;
+            h *= 0xbf58476d1ce4e5b9ULL;
+            h ^= h >> 27;
+            h *= 0x94d049bb133111ebULL;
+            h ^= h >> 31;
+            return h;
+        }
+
+        /**
+         * @brief 按权重抽取一台在线主机，返回其在online中的下标，online不能为空
+         *
+         */
+        static size_t Sample(const Membership &membership)
+        {
+            uint64_t r = Random() % membership.cumWeight.back();
+            return std::upper_bound(membership.cumWeight.begin(), membership.cumWeight.end(), r) - membership.cumWeight.begin();
+        }
+
+        /**
+         * @brief 从下标start开始(含)，找到第一台未被排除、未熔断的在线主机
+         * skip：不考虑的下标，遇到时停止
+         * return：找到时为其下标，否则为online.size()
+         */
+        size_t NextUsable(const Membership &membership, size_t start, size_t skip, int excludeId)
+        {
+            const std::vector<int> &online = membership.online;
+            for (size_t i = 0; i < online.size(); i++)
+            {
+                size_t index = (start + i) % online.size();
+                if (index == skip)
+                {
+                    break;
+                }
+                if (online[index] != excludeId && membership.machines[online[index]]->GetBreaker().Available())
+                {
+                    return index;
+                }
+            }
+            return online.size();
+        }
+
+        /**
+         * @brief 线程私有的随机数，选择主机时不共享状态
+         *
+         */
+        static uint32_t Random()
+        {
+            static thread_local std::minstd_rand rng(std::random_device{}());
+            return rng();
+        }
+
+        /**
+         * @brief 负载拉取线程，每 loadPollIntervalMs 发布一轮在线主机，由 loadPollThreads 个线程并发请求 /load
+         * 每轮先拉取正常的主机，上次拉取失败的主机排在后面，且最多占用一半的拉取线程，无响应的主机不会推迟其他主机的上报
+         * 拉取失败只使该主机的上报过期，是否离线仍由判题请求决定
+         */
+        void PollLoad()
+        {
+            std::vector<std::thread> workers;
+            for (int i = 0; i < loadPollThreads; i++)
+            {
+                workers.emplace_back(&LoadBlance::PollWorker, this);
+            }
+            while (!_pollStop)
+            {
+                std::shared_ptr<const Membership> membership = std::atomic_load(&_membership);
+                std::vector<int> order = membership->online;
+                std::stable_partition(order.begin(), order.end(), [&membership](int id)
+                                      { return !membership->machines[id]->PollFailing(); });
+                {
+                    std::lock_guard<std::mutex> lock(_pollMtx);
+                    _pollRound = membership;
+                    _pollOrder.swap(order);
+                    _pollNext = 0;
+                }
+                _pollCv.notify_all();
+
+                for (int waited = 0; waited < loadPollIntervalMs && !_pollStop; waited += 50)
+                {
+                    usleep(50 * 1000);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(_pollMtx);
+            }
+            _pollCv.notify_all();
+            for (auto &worker : workers)
+            {
+                worker.join();
+            }
+        }
+
+        /**
+         * @brief 拉取线程：领取本轮尚未拉取的主机，跳过正在被其他线程拉取或处于退避中的主机
+         *
+         */
+        void PollWorker()
+        {
+            while (true)
+            {
+                std::shared_ptr<const Membership> round;
+                int id;
+                {
+                    std::unique_lock<std::mutex> lock(_pollMtx);
+                    _pollCv.wait(lock, [this]
+                                 { return _pollStop || _pollNext < _pollOrder.size(); });
+                    if (_pollStop)
+                    {
+                        return;
+                    }
+                    round = _pollRound;
+                    id = _pollOrder[_pollNext++];
+                }
+                Machine &m = *round->machines[id];
+                bool failing = m.PollFailing();
+                if (failing && _pollFailingBusy.fetch_add(1) >= loadPollThreads / 2)
+                {
+                    _pollFailingBusy--;
+                    continue;
+                }
+                if (m.TryBeginPoll())
+                {
+                    m.EndPoll(PollOne(m));
+                }
+                if (failing)
+                {
+                    _pollFailingBusy--;
+                }
+            }
+        }
+
+        /**
+         * @brief 请求一台主机的 /load 并记录
+         * return：得到有效的上报时为真
+         */
+        static bool PollOne(Machine &m)
+        {
+            auto res = m.PollClient().Get("/load");
+            if (!res || res->status != 200)
+            {
+                return false;
+            }
+            Json::Reader reader;
+            Json::Value loadVal;
+            if (!reader.parse(res->body, loadVal))
+            {
+                return false;
+            }
+            LoadReport report;
+            report.running = loadVal["running"].asUInt64();
+            report.queued = loadVal["queued"].asUInt64();
+            report.cores = loadVal["cores"].asInt();
+            report.loadAvg = loadVal["loadavg"].asDouble();
+            report.memAvailableKB = loadVal["memAvailableKB"].asInt64();
+            report.memTotalKB = loadVal["memTotalKB"].asInt64();
+            m.SetReport(report);
+            return true;
+        }
+
+        /**
+         * @brief 探测线程，按指数退避的间隔请求离线主机的 /load，有响应即单独上线该主机
+         * 每台离线主机独立退避：首次等待 probeInitialBackoffMs，失败后翻倍，最多 probeMaxBackoffMs
+         */
+        void ProbeOffline()
+        {
+            typedef std::chrono::steady_clock Clock;
+            struct ProbeState
+            {
+                Clock::time_point next; // 下一次探测的时间
+                int backoffMs;          // 当前的退避间隔
+            };
+            std::unordered_map<int, ProbeState> states; // 离线主机ID -> 探测状态
+
+            while (!_pollStop)
+            {
+                std::shared_ptr<const Membership> membership = std::atomic_load(&_membership);
+                Clock::time_point now = Clock::now();
+
+                // 丢弃已上线主机的状态，新离线的主机从初始间隔开始
+                std::unordered_map<int, ProbeState> current;
+                for (int id : membership->offline)
+                {
+                    auto iter = states.find(id);
+                    if (iter != states.end())
+                    {
+                        current[id] = iter->second;
+                    }
+                    else
+                    {
+                        current[id] = ProbeState{now + std::chrono::milliseconds(probeInitialBackoffMs), probeInitialBackoffMs};
+                    }
+                }
+                states.swap(current);
+
+                for (auto &item : states)
+                {
+                    ProbeState &state = item.second;
+                    if (now < state.next)
+                    {
+                        continue;
+                    }
+                    Machine &m = *membership->machines[item.first];
+                    httplib::Client cli(m.GetIp(), m.GetPort());
+                    cli.set_connection_timeout(0, probeTimeoutMs * 1000);
+                    cli.set_read_timeout(0, probeTimeoutMs * 1000);
+                    auto res = cli.Get("/load");
+                    if (res && res->status == 200)
+                    {
+                        OnlineMachine(item.first);
+                        continue;
+                    }
+                    state.backoffMs = std::min(state.backoffMs * 2, probeMaxBackoffMs);
+                    state.next = Clock::now() + std::chrono::milliseconds(state.backoffMs);
+                }
+
+                usleep(100 * 1000);
+            }
+        }
+
+        /**
+         * @brief 监视配置文件所在的目录(编辑器常以写新文件再重命名的方式保存)
+         * return：inotify描述符，失败时为-1，此时修改配置后需重启服务
+         */
+        static int WatchConfInit(const std::string &path)
+        {
+            size_t slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+            int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+            if (fd < 0)
+            {
+                LOG(ERROR) << "监视主机配置文件失败，修改配置后需重启服务：" << strerror(errno) << std::endl;
+            }
+            return fd;
+        }
+
+        /**
+         * @brief 配置文件监视线程
+         * 配置文件被写入或替换后，等待 confReloadDelayMs 内没有新的变化再重新加载
+         * 同时清理已没有请求的摘除中主机
+         */
+        void WatchConf(const std::string &path)
+        {
+            typedef std::chrono::steady_clock Clock;
+            size_t slash = path.rfind('/');
+            std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+            int fd = _confFd;
+
+            bool changed = false;
+            Clock::time_point reloadAt;
+            alignas(struct inotify_event) char buf[4096];
+            while (!_pollStop)
+            {
+                if (fd < 0)
+                {
+                    usleep(100 * 1000);
+                }
+                else
+                {
+                    struct pollfd pfd = {fd, POLLIN, 0};
+                    if (poll(&pfd, 1, 100) > 0)
+                    {
+                        ssize_t n = 0;
+                        while ((n = read(fd, buf, sizeof(buf))) > 0)
+                        {
+                            for (char *p = buf; p < buf + n;)
+                            {
+                                struct inotify_event *event = reinterpret_cast<struct inotify_event *>(p);
+                                if (event->len > 0 && name == event->name)
+                                {
+                                    changed = true;
+                                    reloadAt = Clock::now() + std::chrono::milliseconds(confReloadDelayMs);
+                                }
+                                p += sizeof(struct inotify_event) + event->len;
+                            }
+                        }
+                    }
+                }
+                if (changed && Clock::now() >= reloadAt)
+                {
+                    changed = false;
+                    LOG(INFO) << "主机配置文件已修改，重新加载\n";
+                    LoadConf(path);
+                }
+                ReleaseDrained();
+            }
+        }
+
+        /**
+         * @brief 摘除中的主机上没有未完成的请求后，从摘除列表中移除，主机对象保留
+         *
+         */
+        void ReleaseDrained()
+        {
+            std::shared_ptr<const Membership> current = std::atomic_load(&_membership);
+            bool any = false;
+            for (int id : current->draining)
+            {
+                any = any || current->machines[id]->GetLoad() == 0;
+            }
+            if (!any)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(_mtx);
+            std::shared_ptr<Membership> membership = std::make_shared<Membership>(*std::atomic_load(&_membership));
+            for (auto iter = membership->draining.begin(); iter != membership->draining.end();)
+            {
+                Machine &m = *membership->machines[*iter];
+                if (m.GetLoad() > 0)
+                {
+                    ++iter;
+                    continue;
+                }
+                LOG(INFO) << "主机摘除完成，主机ID：" << *iter << "，主机：" << m.GetIp() << ":" << m.GetPort() << std::endl;
+                m.ResetReport();
+                iter = membership->draining.erase(iter);
+            }
+            Publish(membership);
+        }
+
+    private:
+        std::shared_ptr<const Membership> _membership;   // 当前的主机与在线/离线列表，通过atomic_load/atomic_store读取与替换
+        std::mutex _mtx;                                 // 只串行化上线/离线操作，选择主机不加锁
+        RouteMode _routeMode;                            // 选择主机的方式，启动时设置
+        std::atomic<bool> _pollStop;                     // 通知负载拉取线程、探测线程退出
+        std::thread _poller;                             // 负载拉取线程，发布每一轮要拉取的主机
+        std::mutex _pollMtx;                             // 保护_pollRound、_pollOrder与_pollNext
+        std::condition_variable _pollCv;                 // 新一轮开始或退出时唤醒拉取线程
+        std::shared_ptr<const Membership> _pollRound;    // 本轮的主机快照
+        std::vector<int> _pollOrder;                     // 本轮要拉取的主机ID，正常的主机在前
+        size_t _pollNext = 0;                            // 本轮下一台待领取主机在_pollOrder中的下标
+        std::atomic<int> _pollFailingBusy{0};            // 正在拉取上次失败主机的线程数
+        std::thread _prober;                             // 离线主机探测线程
+        std::thread _watcher;                            // 配置文件监视线程
+        int _confFd;                                     // 监视配置文件的inotify描述符，-1为未监视
+    };
+}
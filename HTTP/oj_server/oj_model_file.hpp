@@ -6,6 +6,7 @@
 #include <unordered_map>
 #include <cassert>
 #include <fstream>
+#include <memory>
 
 #include "../comm/log.hpp"
 #include "../comm/util.hpp"
@@ -16,6 +17,20 @@ namespace ns_model
     using namespace ns_log;
     using namespace ns_util;
 
+    // 一组测试用例，程序读入input，输出与output比对
+    struct TestCase
+    {
+        std::string input;
+        std::string output;
+    };
+
+    // 一道题目的全部测试用例，加载后不再修改，多个请求共享
+    struct TestData
+    {
+        std::string version;         // 全部输入与期望输出的哈希，编译服务按 题号+版本 缓存
+        std::vector<TestCase> cases;
+    };
+
     // 题目相关信息
     struct Question
     {
@@ -25,6 +40,8 @@ namespace ns_model
         std::string desc; // 题目描述
         std::string header; // 题目预设代码
         std::string tail; // 测试用例
+        std::string harness; // 测试框架，单独编译后与代码链接(可为空)
+        std::shared_ptr<const TestData> tests; // 数据驱动的测试用例(可为空)
         int cpuLimit; // 时间限制 (s)
         int memLimit; // 空间限制 (KB)
     };
@@ -75,6 +92,10 @@ namespace ns_model
                 FileUtil::ReadFile(numberQuestionPath + "desc.txt", &(q.desc), true);
                 FileUtil::ReadFile(numberQuestionPath + "header.cpp", &(q.header), true);
                 FileUtil::ReadFile(numberQuestionPath + "tail.cpp", &(q.tail), true);
+                // 测试框架可选，不存在时为空
+                FileUtil::ReadFile(numberQuestionPath + "harness.cpp", &(q.harness), true);
+                // 测试数据可选，见LoadTests
+                q.tests = LoadTests(numberQuestionPath + "tests/");
 
                 _questionsMap.insert({q.number, q});
             }
@@ -117,6 +138,43 @@ namespace ns_model
             (*que) = iter->second;
             return true;
         }
+    private:
+        /**
+         * @brief 加载测试数据目录中的用例：N.in 为输入，N.out 为期望输出
+         * 目录不存在或没有用例时为nullptr，缺少期望输出的输入被忽略
+         * 版本为全部输入与期望输出的哈希，与编译服务对未带版本的请求的计算方式一致
+         */
+        static std::shared_ptr<const TestData> LoadTests(const std::string &dir)
+        {
+            std::vector<std::string> names;
+            if (!FileUtil::ListFiles(dir, ".in", &names))
+            {
+                return nullptr;
+            }
+            std::shared_ptr<TestData> tests = std::make_shared<TestData>();
+            std::string data;
+            for (const auto &name : names)
+            {
+                TestCase tc;
+                if (!FileUtil::ReadFile(dir + name + ".in", &tc.input, true) || !FileUtil::ReadFile(dir + name + ".out", &tc.output, true))
+                {
+                    LOG(WARNING) << "测试用例缺少输入或期望输出：" << dir << name << std::endl;
+                    continue;
+                }
+                data += tc.input;
+                data += '\0';
+                data += tc.output;
+                data += '\0';
+                tests->cases.push_back(tc);
+            }
+            if (tests->cases.empty())
+            {
+                return nullptr;
+            }
+            tests->version = StringUtil::HashToHex(data);
+            return tests;
+        }
+
     private:
         std::unordered_map<std::string, Question> _questionsMap; // 编号->信息
     };
@@ -6,6 +6,9 @@
 #include <unordered_map>
 #include <cassert>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
 
 #include "../comm/log.hpp"
 #include "../comm/util.hpp"
@@ -18,6 +21,20 @@ namespace ns_model
     using namespace ns_log;
     using namespace ns_util;
 
+    // 一组测试用例，程序读入input，输出与output比对
+    struct TestCase
+    {
+        std::string input;
+        std::string output;
+    };
+
+    // 一道题目的全部测试用例，加载后不再修改，多个请求共享
+    struct TestData
+    {
+        std::string version;         // 全部输入与期望输出的哈希，编译服务按 题号+版本 缓存
+        std::vector<TestCase> cases;
+    };
+
     // 题目相关信息
     struct Question
     {
@@ -27,6 +44,8 @@ namespace ns_model
         std::string desc;   // 题目描述
         std::string header; // 题目预设代码
         std::string tail;   // 测试用例
+        std::string harness; // 测试框架，单独编译后与代码链接(可为空)
+        std::shared_ptr<const TestData> tests; // 数据驱动的测试用例(可为空)
         int cpuLimit;       // 时间限制 (s)
         int memLimit;       // 空间限制 (KB)
     };
@@ -41,9 +60,9 @@ namespace ns_model
 
         /**
          * @brief 查询sql
-         * 
+         * loadTests：是否加载测试数据，只有判题需要
          */
-        bool QueryMysql(const std::string &sql, std::vector<Question> *out)
+        bool QueryMysql(const std::string &sql, std::vector<Question> *out, bool loadTests = false)
         {
             // 创建mysql句柄
             MYSQL *my = mysql_init(nullptr);
@@ -90,6 +109,14 @@ namespace ns_model
                 que.tail = curRow[5];
                 que.cpuLimit = std::atoi(curRow[6]);
                 que.memLimit = std::atoi(curRow[7]);
+                // 测试框架列可选，旧表结构中不存在
+                que.harness = (cols > 8 && curRow[8]) ? curRow[8] : "";
+                // 测试数据目录列可选，数据较大，不放入数据库，见LoadTests
+                if (loadTests && cols > 9 && curRow[9] && curRow[9][0])
+                {
+                    std::string dir = curRow[9];
+                    que.tests = GetTests(dir.back() == '/' ? dir : dir + "/");
+                }
                 // 放入out
                 out->push_back(que);
             }
@@ -121,7 +148,7 @@ namespace ns_model
             sql += " where number = ";
             sql += number;
             std::vector<Question> resl;
-            if (QueryMysql(sql, &resl))
+            if (QueryMysql(sql, &resl, true))
             {
                 if (resl.size() == 1)
                 {
@@ -132,5 +159,101 @@ namespace ns_model
 
             return false;
         }
+
+    private:
+        struct TestsEntry
+        {
+            std::string signature; // 目录中各文件的大小与修改时间
+            std::shared_ptr<const TestData> tests;
+        };
+
+        /**
+         * @brief 获取测试数据目录中的用例，文件未变化时复用已加载的用例与版本
+         * 每次查询题目都会调用，只检查文件的大小与修改时间，不重新读取与计算哈希
+         */
+        std::shared_ptr<const TestData> GetTests(const std::string &dir)
+        {
+            std::string signature = TestsSignature(dir);
+            {
+                std::lock_guard<std::mutex> lock(_testsMtx);
+                auto iter = _testsCache.find(dir);
+                if (iter != _testsCache.end() && iter->second.signature == signature)
+                {
+                    return iter->second.tests;
+                }
+            }
+            std::shared_ptr<const TestData> tests = LoadTests(dir);
+            std::lock_guard<std::mutex> lock(_testsMtx);
+            _testsCache[dir] = TestsEntry{signature, tests};
+            return tests;
+        }
+
+        /**
+         * @brief 测试数据目录中各文件的大小与修改时间，任一文件变化时随之变化
+         *
+         */
+        static std::string TestsSignature(const std::string &dir)
+        {
+            std::vector<std::string> names;
+            if (!FileUtil::ListFiles(dir, ".in", &names))
+            {
+                return "";
+            }
+            std::string signature;
+            for (const auto &name : names)
+            {
+                for (const char *suffix : {".in", ".out"})
+                {
+                    struct stat st;
+                    if (0 != stat((dir + name + suffix).c_str(), &st))
+                    {
+                        continue;
+                    }
+                    signature += name + suffix + ":" + std::to_string(st.st_size) + ":" +
+                                 std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + ";";
+                }
+            }
+            return signature;
+        }
+
+        /**
+         * @brief 加载测试数据目录中的用例：N.in 为输入，N.out 为期望输出
+         * 目录不存在或没有用例时为nullptr，缺少期望输出的输入被忽略
+         * 版本为全部输入与期望输出的哈希，与编译服务对未带版本的请求的计算方式一致
+         */
+        static std::shared_ptr<const TestData> LoadTests(const std::string &dir)
+        {
+            std::vector<std::string> names;
+            if (!FileUtil::ListFiles(dir, ".in", &names))
+            {
+                return nullptr;
+            }
+            std::shared_ptr<TestData> tests = std::make_shared<TestData>();
+            std::string data;
+            for (const auto &name : names)
+            {
+                TestCase tc;
+                if (!FileUtil::ReadFile(dir + name + ".in", &tc.input, true) || !FileUtil::ReadFile(dir + name + ".out", &tc.output, true))
+                {
+                    LOG(WARNING) << "测试用例缺少输入或期望输出：" << dir << name << std::endl;
+                    continue;
+                }
+                data += tc.input;
+                data += '\0';
+                data += tc.output;
+                data += '\0';
+                tests->cases.push_back(tc);
+            }
+            if (tests->cases.empty())
+            {
+                return nullptr;
+            }
+            tests->version = StringUtil::HashToHex(data);
+            return tests;
+        }
+
+    private:
+        std::unordered_map<std::string, TestsEntry> _testsCache; // 测试数据目录->已加载的用例
+        std::mutex _testsMtx;
     };
 }
\ No newline at end of file
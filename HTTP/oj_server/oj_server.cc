@@ -1,4 +1,5 @@
 #include <iostream>
+#include <thread>
 #include <signal.h>
 
 #include "../comm/httplib.h"
@@ -8,21 +9,131 @@ using namespace httplib;
 using namespace ns_control;
 
 static Control *pCtrl = nullptr;
+const size_t pullHttpThreads = 128; // 拉取模式下的http线程数
+const char *pullTokenHeader = "X-Judge-Token"; // 编译服务领取任务、提交结果时携带共享密钥的请求头
 
 void Recovery(int signo)
 {
     pCtrl->RecoveryMachine();
 }
 
-int main()
+void Usage(std::string proc)
 {
+    std::cerr << "Usage: "
+              << "\n\t" << proc << " [--hedge[=P]] [--hedge-budget=R] [--route=p2c|affinity|binpack] [--dispatch=push|pull]"
+              << " [--pull-listen=ip:port] [--pull-token=TOKEN]"
+              << "\n\t--hedge: 开启对冲请求，判题请求超过近期延迟的P分位数(默认95)未返回时，再发给另一台主机"
+              << "\n\t--hedge-budget: 每个判题请求允许的对冲数，默认0.1，不超过1"
+              << "\n\t--route: 选择编译服务主机的方式，p2c(默认)按负载与延迟，affinity按题号一致性哈希(有界负载)，binpack按内存与CPU槽位装箱"
+              << "\n\t--dispatch: 分发判题任务的方式，push(默认)由oj_server选择主机，pull由编译服务(--pull)从中心队列领取"
+              << "\n\t--pull-listen: 拉取模式下供编译服务领取任务的内部地址，默认127.0.0.1:8085，不对用户开放"
+              << "\n\t--pull-token: 编译服务(--pull-token)须携带的共享密钥，内部地址不是本机时必须设置" << std::endl;
+}
+
+/**
+ * @brief 校验编译服务携带的共享密钥，未设置密钥时不校验
+ * 逐字节比较全部内容，耗时与不匹配的位置无关
+ */
+static bool CheckPullToken(const Request &req, const std::string &token)
+{
+    if (token.empty())
+    {
+        return true;
+    }
+    std::string got = req.get_header_value(pullTokenHeader);
+    unsigned char diff = got.size() == token.size() ? 0 : 1;
+    for (size_t i = 0; i < token.size(); i++)
+    {
+        diff |= token[i] ^ (i < got.size() ? got[i] : 0);
+    }
+    return diff == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    HedgeOptions hedgeOpt;
+    RouteMode routeMode = RouteMode::P2C;
+    DispatchMode dispatchMode = DispatchMode::Push;
+    std::string pullIp = "127.0.0.1";
+    int pullPort = 8085;
+    std::string pullToken;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (opt == "--hedge")
+        {
+            hedgeOpt.enabled = true;
+        }
+        else if (opt.compare(0, 8, "--hedge=") == 0)
+        {
+            hedgeOpt.enabled = true;
+            hedgeOpt.percentile = atof(opt.c_str() + 8);
+        }
+        else if (opt.compare(0, 15, "--hedge-budget=") == 0)
+        {
+            hedgeOpt.budgetRatio = atof(opt.c_str() + 15);
+        }
+        else if (opt == "--route=p2c")
+        {
+            routeMode = RouteMode::P2C;
+        }
+        else if (opt == "--route=affinity")
+        {
+            routeMode = RouteMode::Affinity;
+        }
+        else if (opt == "--route=binpack")
+        {
+            routeMode = RouteMode::BinPack;
+        }
+        else if (opt == "--dispatch=push")
+        {
+            dispatchMode = DispatchMode::Push;
+        }
+        else if (opt == "--dispatch=pull")
+        {
+            dispatchMode = DispatchMode::Pull;
+        }
+        else if (opt.compare(0, 14, "--pull-listen=") == 0 && opt.find(':', 14) != std::string::npos)
+        {
+            size_t colon = opt.find(':', 14);
+            pullIp = opt.substr(14, colon - 14);
+            pullPort = atoi(opt.c_str() + colon + 1);
+        }
+        else if (opt.compare(0, 13, "--pull-token=") == 0)
+        {
+            pullToken = opt.substr(13);
+        }
+        else
+        {
+            Usage(argv[0]);
+            return -1;
+        }
+    }
 
     signal(SIGQUIT, Recovery);
 
     // 用户请求的服务路由功能
     Server svr;
+    // 拉取模式的任务接口：单独监听内部地址，与面向用户的服务分开
+    Server pullSvr;
     Control ctrl;
+    ctrl.SetHedge(hedgeOpt);
+    ctrl.SetRouteMode(routeMode);
+    ctrl.SetDispatchMode(dispatchMode);
     pCtrl = &ctrl;
+    if (dispatchMode == DispatchMode::Pull)
+    {
+        // 每个编译服务的每个空闲线程都占用一个长轮询，判题请求也在等待结果，需要更多的http线程
+        svr.new_task_queue = []
+        { return new ThreadPool(pullHttpThreads); };
+        pullSvr.new_task_queue = []
+        { return new ThreadPool(pullHttpThreads); };
+        if (pullToken.empty() && pullIp != "127.0.0.1" && pullIp != "localhost")
+        {
+            LOG(FATAL) << "拉取模式的内部地址不是本机时必须设置--pull-token" << std::endl;
+            return -1;
+        }
+    }
 
     // 1. 获取所有的题目列表
     svr.Get("/all_questions", [&ctrl](const Request &req, Response &resp)
@@ -52,6 +163,37 @@ int main()
                  ctrl.Judge(number, req.body, &resultJson);
                  resp.set_content(resultJson, "application/json; charset=utf-8");
              });
+    // 拉取模式：编译服务领取任务，?wait=ms 时长轮询，有任务返回200与{"lease","request"}，超时返回204
+    // 未携带正确的共享密钥时返回401
+    pullSvr.Get("/judge_tasks", [&ctrl, &pullToken](const Request &req, Response &resp)
+                {
+                    if (!CheckPullToken(req, pullToken))
+                    {
+                        resp.status = 401;
+                        return;
+                    }
+                    int waitMs = req.has_param("wait") ? atoi(req.get_param_value("wait").c_str()) : 0;
+                    std::string taskJson;
+                    if (!ctrl.FetchJudgeTask(waitMs, &taskJson))
+                    {
+                        resp.status = 204;
+                        return;
+                    }
+                    resp.set_content(taskJson, "application/json; charset=utf-8");
+                });
+
+    // 拉取模式：编译服务凭领取时的租约号提交结果，正文为outJson，租约号无效或任务已放弃时返回404
+    pullSvr.Post(R"(/judge_tasks/([0-9a-f]+)/result)", [&ctrl, &pullToken](const Request &req, Response &resp)
+                 {
+                     if (!CheckPullToken(req, pullToken))
+                     {
+                         resp.status = 401;
+                         return;
+                     }
+                     std::string lease = req.matches[1];
+                     resp.status = ctrl.CompleteJudgeTask(lease, req.body) ? 204 : 404;
+                 });
+
     // 4. 错误处理
     svr.set_error_handler([](const Request &req, Response &res)
                           {
@@ -108,6 +250,19 @@ int main()
     svr.set_keep_alive_max_count(10); // Default is 5
     svr.set_keep_alive_timeout(10);   // Default is 5
 
+    if (dispatchMode == DispatchMode::Pull)
+    {
+        if (!pullSvr.bind_to_port(pullIp.c_str(), pullPort))
+        {
+            LOG(FATAL) << "拉取模式的内部地址监听失败：" << pullIp << ":" << pullPort << std::endl;
+            return -1;
+        }
+        LOG(INFO) << "拉取模式的任务接口：" << pullIp << ":" << pullPort << std::endl;
+        std::thread([&pullSvr]
+                    { pullSvr.listen_after_bind(); })
+            .detach();
+    }
+
     svr.listen("0.0.0.0", 8084);
 
     return 0;
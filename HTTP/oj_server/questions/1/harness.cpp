@@ -0,0 +1,35 @@
+#include <iostream>
+
+// 由tail.cpp提供，调用用户代码
+int SolutionSum(int a, int b);
+
+struct TestCase
+{
+    int a;
+    int b;
+    int expect;
+};
+
+const TestCase testCases[] = {
+    {1, 1, 2},
+    {-1, 1, 0},
+};
+
+int main()
+{
+    int idx = 0;
+    for (const auto &tc : testCases)
+    {
+        ++idx;
+        if (tc.expect == SolutionSum(tc.a, tc.b))
+        {
+            std::cout << "用例" << idx << "<span style = \"color:#2DB55D\">通过</span>，测试用例：" << tc.a << ", " << tc.b << "<br>" << std::endl;
+        }
+        else
+        {
+            std::cout << "用例" << idx << "<span style = \"color:#EF4743\">未通过</span>，测试用例：" << tc.a << ", " << tc.b << "<br>" << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -7,11 +7,6 @@
 #include <sys/resource.h>
 #include <unistd.h>
 
-void handleAlarm(int signum)
-{
-    exit(SIGALRM);
-}
-
 void Test1()
 {
     Solution t;
@@ -41,10 +36,6 @@ void Test2()
 
 int main()
 {
-    // 设置信号处理函数
-    signal(SIGALRM, handleAlarm);
-    // 设置 1*2 秒的定时器
-    alarm(2);
     Test1();
     Test2();
 